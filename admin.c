@@ -221,7 +221,7 @@ static void __nvmev_admin_get_log_page(int eid)
 	}
 	case NVME_LOG_FDP_STATS: {
 		struct nvme_fdp_stats_log fdp_stats = { 0 };
-		uint64_t host_written, media_written;
+		uint64_t host_written, media_written, media_erased;
 
 		/* Get current statistics from vdev */
 		host_written = atomic64_read(&vdev->host_write);
@@ -231,11 +231,12 @@ static void __nvmev_admin_get_log_page(int eid)
 		/* Store as 128-bit little-endian (lower 64 bits only) */
 		memcpy(fdp_stats.hbmw, &host_written, sizeof(uint64_t));
 		memcpy(fdp_stats.mbmw, &media_written, sizeof(uint64_t));
-		/* MBE (Media Bytes Erased) - not tracked, set to 0 */
+		media_erased = atomic64_read(&vdev->media_erase);
+		memcpy(fdp_stats.mbe, &media_erased, sizeof(uint64_t));
 
 		__memcpy(page, &fdp_stats, min(len, (uint32_t)sizeof(fdp_stats)));
-		NVMEV_DEBUG("FDP Stats: host_written=%llu, media_written=%llu\n",
-			    host_written, media_written);
+		NVMEV_DEBUG("FDP Stats: host_written=%llu, media_written=%llu, media_erased=%llu\n",
+			    host_written, media_written, media_erased);
 		break;
 	}
 	default:
@@ -24,205 +24,118 @@ extern struct nvmev_dev *vdev;
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(vdev->config.cpu_nr_dispatcher[0]);
+	return nvmev_clock();
 }
 
 void pci_chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/)
 {
-	ch->head = 0;
-	ch->valid_len = 0;
-	ch->cur_time = 0;
-	ch->max_credits = PCI_BANDWIDTH_TO_MAX_CREDITS(bandwidth);
-	ch->command_credits = 0;
+	ch->unit_xfer_size = PCI_UNIT_XFER_SIZE;
 	ch->xfer_lat = PCI_BANDWIDTH_TO_TX_TIME(bandwidth);
+	ch->nr_busy = 0;
 
-	MEMSET(&(ch->avail_credits[0]), ch->max_credits, NR_CREDIT_ENTRIES);
-
-	NVMEV_INFO("[%s] PCI bandwidth %llu max_credits %u tx_time %u\n", __FUNCTION__, bandwidth, ch->max_credits,
-			   ch->xfer_lat);
+	NVMEV_INFO("[%s] PCI bandwidth %llu tx_time %u\n", __FUNCTION__, bandwidth, ch->xfer_lat);
 }
 
 void chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/)
 {
-	ch->head = 0;
-	ch->valid_len = 0;
-	ch->cur_time = 0;
-	ch->max_credits = BANDWIDTH_TO_MAX_CREDITS(bandwidth);
-	ch->command_credits = 0;
+	ch->unit_xfer_size = UNIT_XFER_SIZE;
 	ch->xfer_lat = BANDWIDTH_TO_TX_TIME(bandwidth);
+	ch->nr_busy = 0;
 
-	MEMSET(&(ch->avail_credits[0]), ch->max_credits, NR_CREDIT_ENTRIES);
-
-	NVMEV_INFO("[%s] bandwidth %llu max_credits %u tx_time %u\n", __FUNCTION__, bandwidth, ch->max_credits,
-			   ch->xfer_lat);
+	NVMEV_INFO("[%s] bandwidth %llu tx_time %u\n", __FUNCTION__, bandwidth, ch->xfer_lat);
 }
 
-uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length)
+static void __chmodel_del(struct channel_model *ch, uint32_t from, uint32_t nr)
 {
-	uint64_t cur_time = __get_wallclock();
-	uint32_t pos, next_pos;
-	uint32_t remaining_credits, consumed_credits;
-	uint32_t default_delay, delay = 0;
-	uint32_t valid_length;
-	uint64_t total_latency;
-	uint32_t units_to_xfer = DIV_ROUND_UP(length, UNIT_XFER_SIZE);
-	uint32_t cur_time_offs, request_time_offs;
-	if (request_time < cur_time) {
-		NVMEV_DEBUG("[%s] Reqeust time is before the current time %llu %llu\n", __FUNCTION__, request_time, cur_time);
-		// return request_time; // return minimum delay
-		cur_time = request_time;
-	}
-
-	// Search current time index and move head to it
-	cur_time_offs = (cur_time / UNIT_TIME_INTERVAL) - (ch->cur_time / UNIT_TIME_INTERVAL);
-	cur_time_offs = (cur_time_offs < ch->valid_len) ? cur_time_offs : ch->valid_len;
-
-	if (ch->head + cur_time_offs >= NR_CREDIT_ENTRIES) {
-		MEMSET(&(ch->avail_credits[ch->head]), ch->max_credits, NR_CREDIT_ENTRIES - ch->head);
-		MEMSET(&(ch->avail_credits[0]), ch->max_credits, cur_time_offs - (NR_CREDIT_ENTRIES - ch->head));
-	} else {
-		MEMSET(&(ch->avail_credits[ch->head]), ch->max_credits, cur_time_offs);
-	}
-
-	ch->head = (ch->head + cur_time_offs) % NR_CREDIT_ENTRIES;
-	ch->cur_time = cur_time;
-	ch->valid_len = ch->valid_len - cur_time_offs;
-
-	if (ch->valid_len > NR_CREDIT_ENTRIES) {
-		NVMEV_ERROR("[%s] Invalid valid_len %u\n", __FUNCTION__, ch->valid_len);
-		ch->valid_len = NR_CREDIT_ENTRIES;
-	}
-
-	//Search request time index
-	request_time_offs = (request_time / UNIT_TIME_INTERVAL) - (cur_time / UNIT_TIME_INTERVAL);
-
-	if (request_time_offs >= NR_CREDIT_ENTRIES) {
-		NVMEV_ERROR_LIMIT("[%s] Need to increase array size %llu %llu %u\n", __FUNCTION__, request_time, cur_time,
-					request_time_offs);
-		return request_time; // return minimum delay
-	}
+	memmove(&ch->busy[from], &ch->busy[from + nr], sizeof(ch->busy[0]) * (ch->nr_busy - from - nr));
+	ch->nr_busy -= nr;
+}
 
-	pos = (ch->head + request_time_offs) % NR_CREDIT_ENTRIES;
-	remaining_credits = units_to_xfer * UNIT_XFER_CREDITS;
-	remaining_credits += ch->command_credits;
-
-	default_delay = remaining_credits / ch->max_credits;
-	delay = 0;
-
-	while (1) {
-		consumed_credits = (remaining_credits <= ch->avail_credits[pos]) ? remaining_credits : ch->avail_credits[pos];
-		ch->avail_credits[pos] -= consumed_credits;
-		remaining_credits -= consumed_credits;
-
-		if (remaining_credits) {
-			next_pos = (pos + 1) % NR_CREDIT_ENTRIES;
-			// If array is full
-			if (next_pos != ch->head) {
-				delay++;
-				pos = next_pos;
-			} else {
-				NVMEV_ERROR_LIMIT("[%s] No free entry %llu %llu %u\n", __FUNCTION__, request_time, cur_time,
-							request_time_offs);
-				break;
-			}
-		} else
-			break;
+/* out of room: the two intervals with the shortest gap between them become one */
+static void __chmodel_compact(struct channel_model *ch)
+{
+	uint64_t gap, min_gap = U64_MAX;
+	uint32_t i, at = 0;
+
+	for (i = 0; i + 1 < ch->nr_busy; i++) {
+		gap = ch->busy[i + 1].start - ch->busy[i].end;
+		if (gap < min_gap) {
+			min_gap = gap;
+			at = i;
+		}
 	}
 
-	valid_length = (pos >= ch->head) ? (pos - ch->head + 1) : (NR_CREDIT_ENTRIES - (ch->head - pos - 1));
-
-	if (valid_length > ch->valid_len)
-		ch->valid_len = valid_length;
-
-	// check if array is small..
-	delay = (delay > default_delay) ? (delay - default_delay) : 0;
-
-	total_latency = (ch->xfer_lat * units_to_xfer) + (delay * UNIT_TIME_INTERVAL);
-
-	return request_time + total_latency;
+	ch->busy[at].end = ch->busy[at + 1].end;
+	__chmodel_del(ch, at + 1, 1);
 }
 
-uint64_t pci_chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length)
+/*
+ * Reserve duration of link time in the free gaps from request_time on and
+ * return when the last byte is through. The reserved gaps and the busy
+ * periods in between merge into one interval.
+ */
+static uint64_t __chmodel_reserve(struct channel_model *ch, uint64_t request_time, uint64_t duration)
 {
-	uint64_t cur_time = __get_wallclock();
-	uint32_t pos, next_pos;
-	uint32_t remaining_credits, consumed_credits;
-	uint32_t default_delay, delay = 0;
-	uint32_t valid_length;
-	uint64_t total_latency;
-	uint32_t units_to_xfer = DIV_ROUND_UP(length, PCI_UNIT_XFER_SIZE);
-	uint32_t cur_time_offs, request_time_offs;
-	if (request_time < cur_time) {
-		NVMEV_DEBUG("[%s] Reqeust time is before the current time %llu %llu\n", __FUNCTION__, request_time, cur_time);
-		// return request_time; // return minimum delay
-		cur_time = request_time;
+	uint64_t now = min(__get_wallclock(), request_time);
+	uint64_t t = request_time, remaining = duration, gap_end;
+	struct chmodel_interval merged;
+	uint32_t i, first;
+
+	/* nothing can be reserved before now any more */
+	for (i = 0; i < ch->nr_busy && ch->busy[i].end <= now; i++)
+		;
+	if (i > 0)
+		__chmodel_del(ch, 0, i);
+
+	if (ch->nr_busy == NR_CHMODEL_INTERVALS)
+		__chmodel_compact(ch);
+
+	for (first = 0; first < ch->nr_busy && ch->busy[first].end <= request_time; first++)
+		;
+
+	i = first;
+	while (remaining) {
+		if (i < ch->nr_busy && ch->busy[i].start <= t) {
+			t = ch->busy[i++].end;
+			continue;
+		}
+
+		gap_end = (i < ch->nr_busy) ? ch->busy[i].start : U64_MAX;
+		if (gap_end - t >= remaining) {
+			t += remaining;
+			remaining = 0;
+		} else {
+			remaining -= gap_end - t;
+			t = gap_end;
+		}
 	}
 
-	// Search current time index and move head to it
-	cur_time_offs = (cur_time / PCI_UNIT_TIME_INTERVAL) - (ch->cur_time / PCI_UNIT_TIME_INTERVAL);
-	cur_time_offs = (cur_time_offs < ch->valid_len) ? cur_time_offs : ch->valid_len;
+	merged.start = (first < ch->nr_busy) ? min(request_time, ch->busy[first].start) : request_time;
+	merged.end = t;
+	if (i < ch->nr_busy && ch->busy[i].start == t)
+		merged.end = ch->busy[i++].end;
 
-	if (ch->head + cur_time_offs >= NR_CREDIT_ENTRIES) {
-		MEMSET(&(ch->avail_credits[ch->head]), ch->max_credits, NR_CREDIT_ENTRIES - ch->head);
-		MEMSET(&(ch->avail_credits[0]), ch->max_credits, cur_time_offs - (NR_CREDIT_ENTRIES - ch->head));
+	/* busy[first..i) are covered by merged */
+	if (i > first) {
+		ch->busy[first] = merged;
+		__chmodel_del(ch, first + 1, i - first - 1);
 	} else {
-		MEMSET(&(ch->avail_credits[ch->head]), ch->max_credits, cur_time_offs);
-	}
-
-	ch->head = (ch->head + cur_time_offs) % NR_CREDIT_ENTRIES;
-	ch->cur_time = cur_time;
-	ch->valid_len = ch->valid_len - cur_time_offs;
-
-	if (ch->valid_len > NR_CREDIT_ENTRIES) {
-		NVMEV_ERROR("[%s] Invalid valid_len %u\n", __FUNCTION__, ch->valid_len);
-		ch->valid_len = NR_CREDIT_ENTRIES;
-	}
-
-	//Search request time index
-	request_time_offs = (request_time / PCI_UNIT_TIME_INTERVAL) - (cur_time / PCI_UNIT_TIME_INTERVAL);
-
-	if (request_time_offs >= NR_CREDIT_ENTRIES) {
-		NVMEV_ERROR_LIMIT("[%s] Need to increase array size %llu %llu %u\n", __FUNCTION__, request_time, cur_time,
-					request_time_offs);
-		return request_time; // return minimum delay
-	}
-
-	pos = (ch->head + request_time_offs) % NR_CREDIT_ENTRIES;
-	remaining_credits = units_to_xfer * UNIT_XFER_CREDITS;
-	remaining_credits += ch->command_credits;
-
-	default_delay = remaining_credits / ch->max_credits;
-	delay = 0;
-
-	while (1) {
-		consumed_credits = (remaining_credits <= ch->avail_credits[pos]) ? remaining_credits : ch->avail_credits[pos];
-		ch->avail_credits[pos] -= consumed_credits;
-		remaining_credits -= consumed_credits;
-
-		if (remaining_credits) {
-			next_pos = (pos + 1) % NR_CREDIT_ENTRIES;
-			// If array is full
-			if (next_pos != ch->head) {
-				delay++;
-				pos = next_pos;
-			} else {
-				NVMEV_ERROR_LIMIT("[%s] No free entry %llu %llu %u\n", __FUNCTION__, request_time, cur_time,
-							request_time_offs);
-				break;
-			}
-		} else
-			break;
+		memmove(&ch->busy[first + 1], &ch->busy[first], sizeof(ch->busy[0]) * (ch->nr_busy - first));
+		ch->busy[first] = merged;
+		ch->nr_busy++;
 	}
 
-	valid_length = (pos >= ch->head) ? (pos - ch->head + 1) : (NR_CREDIT_ENTRIES - (ch->head - pos - 1));
-
-	if (valid_length > ch->valid_len)
-		ch->valid_len = valid_length;
+	return t;
+}
 
-	// check if array is small..
-	delay = (delay > default_delay) ? (delay - default_delay) : 0;
+uint64_t chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length)
+{
+	uint64_t units_to_xfer = DIV_ROUND_UP(length, ch->unit_xfer_size);
 
-	total_latency = (ch->xfer_lat * units_to_xfer) + (delay * PCI_UNIT_TIME_INTERVAL);
+	return __chmodel_reserve(ch, request_time, ch->xfer_lat * units_to_xfer);
+}
 
-	return request_time + total_latency;
-}
\ No newline at end of file
+uint64_t pci_chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length)
+{
+	return chmodel_request(ch, request_time, length);
+}
@@ -16,51 +16,31 @@
 #define _CHANNEL_MODEL_H
 
 /* Macros for channel model */
-#define NR_CREDIT_ENTRIES (8 * 1024 * 1024)  // Increased for large GC bursts
-
-#define PCI_UNIT_TIME_INTERVAL (1000ULL) //ns
 #define PCI_UNIT_XFER_SIZE (128ULL) //bytes
-
-#define UNIT_TIME_INTERVAL (2000ULL) //ns
 #define UNIT_XFER_SIZE (32ULL) //bytes
 
-#define UNIT_XFER_CREDITS (1) //credits needed to transfer data(UNIT_XFER_SIZE)
-
-#define SIZE_OF_CREDIT_T 1
-
-#if (SIZE_OF_CREDIT_T == 1)
-typedef uint8_t credit_t;
-#define MEMSET(dest, value, length) memset(dest, value, length)
-
-#elif (SIZE_OF_CREDIT_T == 2)
-typedef uint16_t credit_t;
-#define MEMSET(dest, value, length) memset16(dest, value, length)
+/* busy periods remembered per channel; the closest ones are merged beyond that */
+#define NR_CHMODEL_INTERVALS (64)
 
-#elif (SIZE_OF_CREDIT_T == 4)
-typedef uint32_t credit_t;
-#define MEMSET(dest, value, length) memset32(dest, value, length)
-#else
-#error "Invalid credit size"
-#endif
+struct chmodel_interval {
+	uint64_t start;
+	uint64_t end;
+};
 
+/*
+ * A link is a single server: every transfer reserves link time for its
+ * length, in the free gaps from its request time on. Busy periods are kept
+ * as a sorted list of disjoint intervals.
+ */
 struct channel_model {
-	uint64_t cur_time;
-	uint32_t head;
-	uint32_t valid_len;
-	uint32_t max_credits;
-	uint32_t command_credits;
-	uint32_t xfer_lat; /*XKB NAND CH transfer time in nanoseconds*/
-
-	credit_t avail_credits[NR_CREDIT_ENTRIES];
+	uint32_t unit_xfer_size; /* bytes */
+	uint32_t xfer_lat; /* time to transfer unit_xfer_size bytes in nanoseconds */
+	uint32_t nr_busy;
+	struct chmodel_interval busy[NR_CHMODEL_INTERVALS];
 };
 
 #define BANDWIDTH_TO_TX_TIME(MB_S) (((UNIT_XFER_SIZE)*NS_PER_SEC(1)) / (MB(MB_S)))
-#define BANDWIDTH_TO_MAX_CREDITS(MB_S) \
-	(MB(MB_S) * UNIT_TIME_INTERVAL / NS_PER_SEC(1) / UNIT_XFER_SIZE * UNIT_XFER_CREDITS)
-
 #define PCI_BANDWIDTH_TO_TX_TIME(MB_S) (((PCI_UNIT_XFER_SIZE)*NS_PER_SEC(1)) / (MB(MB_S)))
-#define PCI_BANDWIDTH_TO_MAX_CREDITS(MB_S) \
-	(MB(MB_S) * PCI_UNIT_TIME_INTERVAL / NS_PER_SEC(1) / PCI_UNIT_XFER_SIZE * UNIT_XFER_CREDITS)
 
 uint64_t pci_chmodel_request(struct channel_model *ch, uint64_t request_time, uint64_t length);
 void pci_chmodel_init(struct channel_model *ch, uint64_t bandwidth /*MB/s*/);
@@ -13,6 +13,8 @@
  **********************************************************************/
 
 #include <linux/ktime.h>
+#include <linux/kthread.h>
+#include <linux/prefetch.h>
 #include <linux/sched/clock.h>
 #include <linux/highmem.h>
 #include <linux/vmalloc.h>
@@ -26,37 +28,73 @@
 
 extern struct nvmev_dev *vdev;
 
-void enqueue_writeback_io_req(int sqid, unsigned long long nsecs_target, struct buffer *write_buffer,
-							  unsigned int buffs_to_release);
 void enqueue_gc_io_req(int sqid, unsigned long long nsecs_target, bool is_write, unsigned int io_length);
 
+/*
+ * Pages are striped over the planes of a die before moving to the next
+ * die, so a wordline is complete once its last plane is, and it is then
+ * programmed on all planes with one multi-plane program.
+ */
 static inline bool last_pg_in_wordline(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
-	return (ppa->g.pg % spp->pgs_per_oneshotpg) == (spp->pgs_per_oneshotpg - 1);
+	return (ppa->g.pg % spp->pgs_per_oneshotpg) == (spp->pgs_per_oneshotpg - 1) &&
+		   ppa->g.pl == spp->pls_per_lun - 1;
 }
 
-static inline uint32_t get_gc_thres_lines(struct conv_ftl *conv_ftl)
+static inline uint32_t wordline_size(struct conv_ftl *conv_ftl)
 {
-	/* active RUH count + 1 for GC, minimum 2 */
-	uint32_t thres = conv_ftl->active_ruh_count + 1;
-	return (thres < 2) ? 2 : thres;
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	return spp->pgsz * spp->pgs_per_oneshotpg * spp->pls_per_lun;
 }
 
-static inline bool should_gc_high(struct conv_ftl *conv_ftl)
+/* the wordline ending at ppa was handed to NAND and is programmed at nsecs_completed */
+static void mark_wordline_programmed(struct conv_ftl *conv_ftl, struct ppa *ppa, uint64_t nsecs_completed)
 {
-	return conv_ftl->lm.free_line_cnt <= get_gc_thres_lines(conv_ftl);
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct nand_block *blk;
+	struct ppa wl = *ppa;
+	uint32_t pl;
+
+	for (pl = 0; pl < spp->pls_per_lun; pl++) {
+		wl.g.pl = pl;
+		blk = get_blk(conv_ftl->ssd, &wl);
+		blk->wp = ppa->g.pg + 1;
+		blk->prog_etime = nsecs_completed;
+	}
 }
 
-static inline struct ppa get_maptbl_ent(struct conv_ftl *conv_ftl, uint64_t lpn)
+/*
+ * A written page is still in the controller write buffer until the program
+ * of its wordline completes: either no program covers it yet, or it is in
+ * the last wordline programmed on its block and that program is in flight.
+ */
+static inline bool page_in_write_buffer(struct conv_ftl *conv_ftl, struct ppa *ppa, uint64_t now)
 {
-	return conv_ftl->maptbl[lpn];
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct nand_block *blk = get_blk(conv_ftl->ssd, ppa);
+
+	if ((int)ppa->g.pg >= blk->wp)
+		return true;
+	return (int)(ppa->g.pg + spp->pgs_per_oneshotpg) >= blk->wp && now < blk->prog_etime;
 }
 
-static inline void set_maptbl_ent(struct conv_ftl *conv_ftl, uint64_t lpn, struct ppa *ppa)
+static inline uint32_t get_gc_thres_lines(struct conv_ftl *conv_ftl)
 {
-	NVMEV_ASSERT(lpn < conv_ftl->ssd->sp.tt_pgs);
-	conv_ftl->maptbl[lpn] = *ppa;
+	/*
+	 * active RUH count + one line per GC stream, open or not, minimum 2: the
+	 * survivors of a single victim may open every GC stream at once
+	 */
+	uint32_t thres = conv_ftl->active_ruh_count + conv_ftl->active_gc_streams;
+
+	if (conv_ftl->active_gc_streams < conv_ftl->cp.nr_gc_streams)
+		thres += conv_ftl->cp.nr_gc_streams - conv_ftl->active_gc_streams;
+	return (thres < 2) ? 2 : thres;
+}
+
+static inline bool should_gc_high(struct conv_ftl *conv_ftl)
+{
+	return conv_ftl->lm.free_line_cnt <= get_gc_thres_lines(conv_ftl);
 }
 
 static uint64_t ppa2pgidx(struct conv_ftl *conv_ftl, struct ppa *ppa)
@@ -75,6 +113,65 @@ static uint64_t ppa2pgidx(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	return pgidx;
 }
 
+#if (COMPACT_MAPTBL == 1)
+static inline struct ppa pgidx2ppa(struct conv_ftl *conv_ftl, uint64_t pgidx)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct ppa ppa;
+
+	ppa.ppa = 0;
+	ppa.g.ch = pgidx / spp->pgs_per_ch;
+	pgidx %= spp->pgs_per_ch;
+	ppa.g.lun = pgidx / spp->pgs_per_lun;
+	pgidx %= spp->pgs_per_lun;
+	ppa.g.pl = pgidx / spp->pgs_per_pl;
+	pgidx %= spp->pgs_per_pl;
+	ppa.g.blk = pgidx / spp->pgs_per_blk;
+	ppa.g.pg = pgidx % spp->pgs_per_blk;
+
+	return ppa;
+}
+
+static inline struct ppa get_maptbl_ent(struct conv_ftl *conv_ftl, uint64_t lpn)
+{
+	uint32_t pgidx = conv_ftl->maptbl[lpn];
+
+	if (pgidx == INVALID32)
+		return (struct ppa){ .ppa = UNMAPPED_PPA };
+
+	return pgidx2ppa(conv_ftl, pgidx);
+}
+
+static inline void set_maptbl_ent(struct conv_ftl *conv_ftl, uint64_t lpn, struct ppa *ppa)
+{
+	NVMEV_ASSERT(lpn < conv_ftl->ssd->sp.tt_pgs);
+	conv_ftl->maptbl[lpn] = (ppa->ppa == UNMAPPED_PPA) ? INVALID32 : ppa2pgidx(conv_ftl, ppa);
+}
+
+static inline uint64_t get_rmap_ent(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	uint32_t lpn = conv_ftl->rmap[ppa2pgidx(conv_ftl, ppa)];
+
+	return (lpn == INVALID32) ? INVALID_LPN : lpn;
+}
+
+/* set rmap[page_no(ppa)] -> lpn */
+static inline void set_rmap_ent(struct conv_ftl *conv_ftl, uint64_t lpn, struct ppa *ppa)
+{
+	conv_ftl->rmap[ppa2pgidx(conv_ftl, ppa)] = (lpn == INVALID_LPN) ? INVALID32 : lpn;
+}
+#else
+static inline struct ppa get_maptbl_ent(struct conv_ftl *conv_ftl, uint64_t lpn)
+{
+	return conv_ftl->maptbl[lpn];
+}
+
+static inline void set_maptbl_ent(struct conv_ftl *conv_ftl, uint64_t lpn, struct ppa *ppa)
+{
+	NVMEV_ASSERT(lpn < conv_ftl->ssd->sp.tt_pgs);
+	conv_ftl->maptbl[lpn] = *ppa;
+}
+
 static inline uint64_t get_rmap_ent(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
 	uint64_t pgidx = ppa2pgidx(conv_ftl, ppa);
@@ -89,44 +186,92 @@ static inline void set_rmap_ent(struct conv_ftl *conv_ftl, uint64_t lpn, struct
 
 	conv_ftl->rmap[pgidx] = lpn;
 }
+#endif
+
+/*
+ * Victim index: one list per valid page count. Invalidations move a line
+ * one bucket down and the greedy victim is the head of the lowest
+ * non-empty bucket, found from victim_min_vpc through victim_nonempty.
+ */
+static void victim_reset(struct line_mgmt *lm)
+{
+	uint32_t i;
+
+	for (i = 0; i < lm->nr_victim_buckets; i++)
+		INIT_LIST_HEAD(&lm->victim_buckets[i]);
+	bitmap_zero(lm->victim_nonempty, lm->nr_victim_buckets);
+	lm->victim_min_vpc = lm->nr_victim_buckets;
+	lm->victim_line_cnt = 0;
+}
 
-static inline int victim_line_cmp_pri(pqueue_pri_t next, pqueue_pri_t curr)
+static inline void __victim_add(struct line_mgmt *lm, struct line *line)
 {
-	return (next > curr);
+	list_add_tail(&line->entry, &lm->victim_buckets[line->vpc]);
+	__set_bit(line->vpc, lm->victim_nonempty);
+	if (line->vpc < lm->victim_min_vpc)
+		lm->victim_min_vpc = line->vpc;
 }
 
-static inline pqueue_pri_t victim_line_get_pri(void *a)
+static inline void __victim_del(struct line_mgmt *lm, struct line *line)
 {
-	return ((struct line *)a)->vpc;
+	list_del_init(&line->entry);
+	if (list_empty(&lm->victim_buckets[line->vpc]))
+		__clear_bit(line->vpc, lm->victim_nonempty);
 }
 
-static inline void victim_line_set_pri(void *a, pqueue_pri_t pri)
+static inline void victim_insert(struct line_mgmt *lm, struct line *line)
 {
-	((struct line *)a)->vpc = pri;
+	__victim_add(lm, line);
+	line->victim = true;
+	lm->victim_line_cnt++;
 }
 
-static inline size_t victim_line_get_pos(void *a)
+static inline void victim_remove(struct line_mgmt *lm, struct line *line)
 {
-	return ((struct line *)a)->pos;
+	__victim_del(lm, line);
+	line->victim = false;
+	lm->victim_line_cnt--;
 }
 
-static inline void victim_line_set_pos(void *a, size_t pos)
+/* a page of a victim line was invalidated */
+static inline void victim_dec_vpc(struct line_mgmt *lm, struct line *line)
 {
-	((struct line *)a)->pos = pos;
+	__victim_del(lm, line);
+	line->vpc--;
+	__victim_add(lm, line);
 }
 
-static inline void consume_write_credit(struct conv_ftl *conv_ftl)
+/* the line with the fewest valid pages, NULL if there is none */
+static struct line *victim_peek(struct line_mgmt *lm)
 {
-	conv_ftl->wfc.write_credits--;
+	if (lm->victim_line_cnt == 0)
+		return NULL;
+
+	lm->victim_min_vpc = find_next_bit(lm->victim_nonempty, lm->nr_victim_buckets, lm->victim_min_vpc);
+	NVMEV_ASSERT(lm->victim_min_vpc < lm->nr_victim_buckets);
+	return list_first_entry(&lm->victim_buckets[lm->victim_min_vpc], struct line, entry);
 }
 
+/* all victim lines, by increasing vpc */
+#define for_each_victim_line(lm, vpc, line) \
+	for_each_set_bit(vpc, (lm)->victim_nonempty, (lm)->nr_victim_buckets) \
+		list_for_each_entry(line, &(lm)->victim_buckets[vpc], entry)
+
 static void forground_gc(struct conv_ftl *conv_ftl);
+static void incremental_gc(struct conv_ftl *conv_ftl);
+static int conv_init_shards(struct nvmev_ns *ns);
+static void conv_remove_shards(struct nvmev_ns *ns);
+static void conv_init_bg_gc(struct nvmev_ns *ns);
+static void conv_remove_bg_gc(struct nvmev_ns *ns);
 
 static inline void check_and_refill_write_credit(struct conv_ftl *conv_ftl)
 {
 	struct write_flow_control *wfc = &(conv_ftl->wfc);
 	if (wfc->write_credits <= 0) {
-		forground_gc(conv_ftl);
+		if (conv_ftl->cp.gc_incremental)
+			incremental_gc(conv_ftl);
+		else
+			forground_gc(conv_ftl);
 
 		wfc->write_credits += wfc->credits_to_refill;
 	}
@@ -144,8 +289,10 @@ static void init_lines(struct conv_ftl *conv_ftl)
 	lm->lines = vmalloc_node(sizeof(struct line) * lm->tt_lines, 1);
 
 	INIT_LIST_HEAD(&lm->free_line_list);
-	lm->victim_line_pq = pqueue_init(spp->tt_lines, victim_line_cmp_pri, victim_line_get_pri, victim_line_set_pri,
-									 victim_line_get_pos, victim_line_set_pos);
+	lm->nr_victim_buckets = spp->pgs_per_line + 1;
+	lm->victim_buckets = vmalloc_node(sizeof(struct list_head) * lm->nr_victim_buckets, 1);
+	lm->victim_nonempty = vmalloc_node(sizeof(unsigned long) * BITS_TO_LONGS(lm->nr_victim_buckets), 1);
+	victim_reset(lm);
 	INIT_LIST_HEAD(&lm->full_line_list);
 
 	lm->free_line_cnt = 0;
@@ -154,27 +301,82 @@ static void init_lines(struct conv_ftl *conv_ftl)
 		line->id = i;
 		line->ipc = 0;
 		line->vpc = 0;
-		line->pos = 0;
+		line->victim = false;
+		line->close_seq = 0;
+		line->ruh_mask = 0;
+		line->gc_gen = 0;
+		memset(line->ruh_pgs, 0, sizeof(line->ruh_pgs));
 		/* initialize all the lines as free lines */
 		list_add_tail(&line->entry, &lm->free_line_list);
 		lm->free_line_cnt++;
 	}
 
 	NVMEV_ASSERT(lm->free_line_cnt == lm->tt_lines);
-	lm->victim_line_cnt = 0;
 	lm->full_line_cnt = 0;
+	lm->close_seq = 0;
 }
 
 static void remove_lines(struct conv_ftl *conv_ftl)
 {
-	pqueue_free(conv_ftl->lm.victim_line_pq);
+	vfree(conv_ftl->lm.victim_nonempty);
+	vfree(conv_ftl->lm.victim_buckets);
 	vfree(conv_ftl->lm.lines);
 }
 
-static struct line *get_next_free_line(struct conv_ftl *conv_ftl)
+/* allocate the page state of every block of the line */
+static int materialize_line(struct conv_ftl *conv_ftl, struct line *line)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct ppa ppa = { .ppa = 0 };
+	uint32_t ch, lun, pl;
+
+	ppa.g.blk = line->id;
+	for (ch = 0; ch < spp->nchs; ch++) {
+		for (lun = 0; lun < spp->luns_per_ch; lun++) {
+			for (pl = 0; pl < spp->pls_per_lun; pl++) {
+				ppa.g.ch = ch;
+				ppa.g.lun = lun;
+				ppa.g.pl = pl;
+				if (ssd_materialize_blk(get_blk(conv_ftl->ssd, &ppa)))
+					return -ENOMEM;
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Allocate the page state of the first nr free lines. GC takes its lines
+ * from the head of the free list and cannot back off half way through a
+ * victim, so gc_begin() and every host line open, which both can, keep one
+ * ready line per GC stream there.
+ */
+static int reserve_free_lines(struct conv_ftl *conv_ftl, uint32_t nr)
+{
+	struct line *line;
+
+	list_for_each_entry(line, &conv_ftl->lm.free_line_list, entry) {
+		if (nr-- == 0)
+			break;
+		if (materialize_line(conv_ftl, line))
+			return -ENOMEM;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns NULL if no line is free, or if page state cannot be allocated;
+ * the latter leaves free_line_cnt above zero. Host opens allocate for
+ * their own line and the GC lines behind it, and fail the write if memory
+ * runs out; GC opens find their line ready.
+ */
+static struct line *get_next_free_line(struct conv_ftl *conv_ftl, uint32_t io_type)
 {
 	struct line_mgmt *lm = &conv_ftl->lm;
 	struct line *curline = NULL;
+	uint32_t nr = (io_type == USER_IO) ? 1 + conv_ftl->cp.nr_gc_streams : 1;
 
 	if (list_empty(&lm->free_line_list)) {
 		NVMEV_ERROR("No free lines left! free_line_cnt=%d\n", lm->free_line_cnt);
@@ -182,6 +384,11 @@ static struct line *get_next_free_line(struct conv_ftl *conv_ftl)
 	}
 
 	curline = list_first_entry(&lm->free_line_list, struct line, entry);
+	if (reserve_free_lines(conv_ftl, nr)) {
+		NVMEV_ERROR("No memory for the page state of line %d\n", curline->id);
+		return NULL;
+	}
+
 	list_del_init(&curline->entry);
 	lm->free_line_cnt--;
 	NVMEV_DEBUG("[%s] free_line_cnt %d, got line %d\n", __FUNCTION__, lm->free_line_cnt, curline->id);
@@ -194,7 +401,8 @@ static struct write_pointer *__get_wp(struct conv_ftl *ftl, uint16_t ruh, uint32
 	if (io_type == USER_IO) {
 		return &ftl->wps[ruh];
 	} else if (io_type == GC_IO) {
-		return &ftl->gc_wp;
+		/* ruh is the GC stream here */
+		return &ftl->gc_wps[ruh];
 	} else {
 		NVMEV_ASSERT(0);
 	}
@@ -203,7 +411,7 @@ static struct write_pointer *__get_wp(struct conv_ftl *ftl, uint16_t ruh, uint32
 
 static void prepare_an_write_pointer(struct conv_ftl *conv_ftl, uint16_t ruh, uint32_t io_type) {
 	struct write_pointer *wp = __get_wp(conv_ftl, ruh, io_type);
-	struct line *curline = get_next_free_line(conv_ftl);
+	struct line *curline = get_next_free_line(conv_ftl, io_type);
 
 	NVMEV_ASSERT(wp);
 	NVMEV_ASSERT(curline);
@@ -237,8 +445,13 @@ static void init_write_pointer(struct conv_ftl *conv_ftl, uint32_t io_type)
 		conv_ftl->active_ruh_count = 0;
 		NVMEV_INFO("USER_IO write pointers initialized (lazy, no lines allocated)\n");
 	} else if (io_type == GC_IO) {
+		/* the other GC streams are allocated lazily, like the RUHs */
+		for (int i = 1; i < NR_MAX_RUH; i++)
+			conv_ftl->gc_wps[i] = (struct write_pointer){ .curline = NULL };
+
 		/* GC write pointer needs a line immediately */
 		prepare_an_write_pointer(conv_ftl, 0, io_type);
+		conv_ftl->active_gc_streams = 1;
 	}
 }
 
@@ -270,6 +483,12 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint16_t ruh, uint3
 		goto out;
 	wpp->pg -= spp->pgs_per_flashpg;
 
+	check_addr(wpp->pl, spp->pls_per_lun);
+	wpp->pl++;
+	if (wpp->pl != spp->pls_per_lun)
+		goto out;
+	wpp->pl = 0;
+
 	check_addr(wpp->ch, spp->nchs);
 	wpp->ch++;
 	if (wpp->ch != spp->nchs)
@@ -287,6 +506,8 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint16_t ruh, uint3
 		goto out;
 	wpp->pg = 0;
 
+	wpp->curline->close_seq = ++lm->close_seq;
+
 	/* move current line to {victim,full} line list */
 	if (wpp->curline->vpc == spp->pgs_per_line) {
 		/* all pgs are still valid, move to full line list */
@@ -299,15 +520,22 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint16_t ruh, uint3
 		NVMEV_ASSERT(wpp->curline->vpc >= 0 && wpp->curline->vpc < spp->pgs_per_line);
 		/* there must be some invalid pages in this line */
 		NVMEV_ASSERT(wpp->curline->ipc > 0);
-		pqueue_insert(lm->victim_line_pq, wpp->curline);
-		lm->victim_line_cnt++;
+		victim_insert(lm, wpp->curline);
 	}
 	/* current line is used up, pick another empty line */
 	check_addr(wpp->blk, spp->blks_per_pl);
 	wpp->curline = NULL;
 	{
 		int retry = 0;
-		while ((wpp->curline = get_next_free_line(conv_ftl)) == NULL) {
+		while ((wpp->curline = get_next_free_line(conv_ftl, io_type)) == NULL) {
+			if (lm->free_line_cnt > 0) {
+				/* out of memory: close the stream, get_new_page() retries and fails the write */
+				if (io_type == USER_IO)
+					conv_ftl->active_ruh_count--;
+				else
+					conv_ftl->active_gc_streams--;
+				return;
+			}
 			if (retry++ >= 3) {
 				NVMEV_ERROR("advance_write_pointer: failed to get free line after GC, ruh=%u\n", ruh);
 				BUG();
@@ -325,7 +553,6 @@ static void advance_write_pointer(struct conv_ftl *conv_ftl, uint16_t ruh, uint3
 	NVMEV_ASSERT(wpp->pg == 0);
 	NVMEV_ASSERT(wpp->lun == 0);
 	NVMEV_ASSERT(wpp->ch == 0);
-	/* TODO: assume # of pl_per_lun is 1, fix later */
 	NVMEV_ASSERT(wpp->pl == 0);
 out:
 	NVMEV_DEBUG("advanced wpp: ch:%d, lun:%d, pl:%d, blk:%d, pg:%d (curline %d)\n", wpp->ch, wpp->lun, wpp->pl,
@@ -345,8 +572,8 @@ static struct ppa get_new_page(struct conv_ftl *conv_ftl, uint16_t ruh, uint32_t
 
 		NVMEV_DEBUG("Lazy alloc for ruh=%u io_type=%u\n", ruh, io_type);
 
-		while ((curline = get_next_free_line(conv_ftl)) == NULL) {
-			if (retry++ >= 3) {
+		while ((curline = get_next_free_line(conv_ftl, io_type)) == NULL) {
+			if (conv_ftl->lm.free_line_cnt > 0 || retry++ >= 3) {
 				NVMEV_ERROR("Failed to get free line after GC for ruh=%u\n", ruh);
 				ppa.ppa = UNMAPPED_PPA;
 				return ppa;
@@ -363,6 +590,8 @@ static struct ppa get_new_page(struct conv_ftl *conv_ftl, uint16_t ruh, uint32_t
 		wpp->pl = 0;
 		if (io_type == USER_IO) {
 			conv_ftl->active_ruh_count++;
+		} else {
+			conv_ftl->active_gc_streams++;
 		}
 		NVMEV_INFO("Lazy allocated line %d for ruh=%u io_type=%u (active_ruh=%u)\n",
 			curline->id, ruh, io_type, conv_ftl->active_ruh_count);
@@ -382,19 +611,49 @@ static struct ppa get_new_page(struct conv_ftl *conv_ftl, uint16_t ruh, uint32_t
 					ppa.g.blk, spp->blks_per_pl, ppa.g.pg, spp->pgs_per_blk, ruh, io_type);
 	}
 
-	NVMEV_ASSERT(ppa.g.pl == 0);
 	return ppa;
 }
 
+/*
+ * Like get_new_page(), but reserves up to nr_pages pages that share the
+ * current flash page, i.e. consecutive pages of the same block. Returns how
+ * many were reserved, 0 if no line could be opened; the caller marks them
+ * valid and then moves the write pointer with advance_write_pointer_by().
+ */
+static uint32_t get_new_page_run(struct conv_ftl *conv_ftl, uint16_t ruh, uint32_t io_type, uint32_t nr_pages,
+								 struct ppa *ppa)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+
+	*ppa = get_new_page(conv_ftl, ruh, io_type);
+	if (ppa->ppa == UNMAPPED_PPA)
+		return 0;
+	return min_t(uint32_t, nr_pages, spp->pgs_per_flashpg - (ppa->g.pg % spp->pgs_per_flashpg));
+}
+
+static void advance_write_pointer_by(struct conv_ftl *conv_ftl, uint16_t ruh, uint32_t io_type, uint32_t nr_pages)
+{
+	struct write_pointer *wpp = __get_wp(conv_ftl, ruh, io_type);
+
+	/* the run never crosses a flash page, only its last page can carry */
+	wpp->pg += nr_pages - 1;
+	advance_write_pointer(conv_ftl, ruh, io_type);
+}
+
+/*
+ * UNMAPPED_PPA, INVALID_LPN and INVALID32 are all-ones, so both tables are
+ * initialized by a byte fill that is spread over the worker CPUs.
+ */
 static void init_maptbl(struct conv_ftl *conv_ftl)
 {
-	int i;
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 
-	conv_ftl->maptbl = vmalloc_node(sizeof(struct ppa) * spp->tt_pgs, 1);
-	for (i = 0; i < spp->tt_pgs; i++) {
-		conv_ftl->maptbl[i].ppa = UNMAPPED_PPA;
-	}
+#if (COMPACT_MAPTBL == 1)
+	/* INVALID32 is reserved for unmapped entries */
+	NVMEV_ASSERT(spp->tt_pgs < INVALID32);
+#endif
+	conv_ftl->maptbl = vmalloc_node(sizeof(maptbl_ent_t) * spp->tt_pgs, 1);
+	ssd_parallel_memset(conv_ftl->maptbl, 0xFF, sizeof(maptbl_ent_t) * spp->tt_pgs);
 }
 
 static void remove_maptbl(struct conv_ftl *conv_ftl)
@@ -404,13 +663,10 @@ static void remove_maptbl(struct conv_ftl *conv_ftl)
 
 static void init_rmap(struct conv_ftl *conv_ftl)
 {
-	int i;
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 
-	conv_ftl->rmap = vmalloc_node(sizeof(uint64_t) * spp->tt_pgs, 1);
-	for (i = 0; i < spp->tt_pgs; i++) {
-		conv_ftl->rmap[i] = INVALID_LPN;
-	}
+	conv_ftl->rmap = vmalloc_node(sizeof(rmap_ent_t) * spp->tt_pgs, 1);
+	ssd_parallel_memset(conv_ftl->rmap, 0xFF, sizeof(rmap_ent_t) * spp->tt_pgs);
 }
 
 static void remove_rmap(struct conv_ftl *conv_ftl)
@@ -418,14 +674,282 @@ static void remove_rmap(struct conv_ftl *conv_ftl)
 	vfree(conv_ftl->rmap);
 }
 
+/*
+ * Cached mapping table, DFTL style. Only map_cache_segs segments of the
+ * mapping table are in DRAM; a lookup that misses reads its segment from
+ * NAND first, and the segment it replaces (CLOCK) is written back if dirty.
+ * Written-back segments are gathered into wordlines before they are
+ * programmed. Only the timing is modeled, maptbl itself stays complete.
+ */
+static void init_map_cache(struct conv_ftl *conv_ftl)
+{
+	struct convparams *cpp = &conv_ftl->cp;
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct conv_map_cache *mc = &conv_ftl->mc;
+
+	memset(mc, 0, sizeof(*mc));
+	if (cpp->map_cache_segs == 0)
+		return;
+
+	mc->nr_segs = DIV_ROUND_UP(spp->tt_pgs, cpp->map_seg_lpns);
+	if (cpp->map_cache_segs >= mc->nr_segs)
+		return;
+
+	mc->nr_slots = cpp->map_cache_segs;
+	mc->seg_bytes = cpp->map_seg_lpns * CONV_MAP_ENTRY_SIZE;
+	mc->slot_seg = vmalloc_node(sizeof(uint32_t) * mc->nr_slots, 1);
+	mc->seg_state = vmalloc_node(mc->nr_segs, 1);
+	memset(mc->seg_state, 0, mc->nr_segs);
+}
+
+static void remove_map_cache(struct conv_ftl *conv_ftl)
+{
+	vfree(conv_ftl->mc.slot_seg);
+	vfree(conv_ftl->mc.seg_state);
+}
+
+/*
+ * SLC write cache. slc_lines lines are taken out of the free pool and hold
+ * 1/cell_mode of their TLC capacity. Host wordlines are programmed there in
+ * SLC mode and folded into their TLC location later: while the host is
+ * idle, or one at a time when the cache is full. Data keeps its TLC
+ * address in the mapping table, the cache only shapes the NAND timing.
+ */
+static void init_slc_cache(struct conv_ftl *conv_ftl)
+{
+	struct convparams *cpp = &conv_ftl->cp;
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct conv_slc_cache *slc = &conv_ftl->slc;
+	uint32_t i;
+
+	memset(slc, 0, sizeof(*slc));
+	if (cpp->slc_lines == 0)
+		return;
+
+	if (spp->cell_mode == CELL_MODE_SLC ||
+		cpp->slc_lines + cpp->gc_thres_lines_high + NR_MAX_RUH > lm->free_line_cnt) {
+		NVMEV_ERROR("SLC cache of %u lines does not fit, disabled\n", cpp->slc_lines);
+		return;
+	}
+
+	/* SLC lines never hold mapped pages, so their page state is not allocated */
+	for (i = 0; i < cpp->slc_lines; i++) {
+		struct line *line = list_first_entry(&lm->free_line_list, struct line, entry);
+
+		list_del_init(&line->entry);
+		lm->free_line_cnt--;
+	}
+
+	slc->nr_lines = cpp->slc_lines;
+	slc->capacity = (uint64_t)slc->nr_lines * spp->pgs_per_line / spp->cell_mode /
+					(spp->pgs_per_oneshotpg * spp->pls_per_lun);
+	slc->fold_q = vmalloc_node(sizeof(struct conv_slc_wl) * slc->capacity, 1);
+
+	NVMEV_INFO("SLC cache: %u lines, %u wordlines\n", slc->nr_lines, slc->capacity);
+}
+
+static void remove_slc_cache(struct conv_ftl *conv_ftl)
+{
+	vfree(conv_ftl->slc.fold_q);
+}
+
+/* any page of the wordline ending at ppa still valid */
+static bool wordline_has_valid(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	uint32_t first = ppa->g.pg + 1 - spp->pgs_per_oneshotpg;
+	struct nand_block *blk;
+	struct ppa wl = *ppa;
+	uint32_t pl;
+
+	for (pl = 0; pl < spp->pls_per_lun; pl++) {
+		wl.g.pl = pl;
+		blk = get_blk(conv_ftl->ssd, &wl);
+		if (blk->pg_valid && find_next_bit(blk->pg_valid, ppa->g.pg + 1, first) <= ppa->g.pg)
+			return true;
+	}
+	return false;
+}
+
+/* oldest cached wordline: read it back from SLC and program it in TLC */
+static void slc_fold_one(struct conv_ftl *conv_ftl, uint64_t stime)
+{
+	struct conv_slc_cache *slc = &conv_ftl->slc;
+	struct conv_slc_wl *wl = &slc->fold_q[slc->head];
+	struct nand_cmd ncmd = {
+		.type = GC_IO,
+		.cmd = NAND_READ,
+		.stime = stime,
+		.xfer_size = wordline_size(conv_ftl),
+		.true_size = wordline_size(conv_ftl),
+		.interleave_pci_dma = false,
+		.ppa = &wl->ppa,
+	};
+
+	slc->head = (slc->head + 1) % slc->capacity;
+	slc->nr_cached--;
+
+	if (get_blk(conv_ftl->ssd, &wl->ppa)->erase_cnt != wl->erase_cnt ||
+		!wordline_has_valid(conv_ftl, &wl->ppa)) {
+		slc->dropped++;
+		return;
+	}
+
+	ncmd.stime = ssd_advance_nand(conv_ftl->ssd, &ncmd);
+	ncmd.cmd = NAND_WRITE;
+	ssd_advance_nand(conv_ftl->ssd, &ncmd);
+	slc->folded++;
+}
+
+/* background folding takes the oldest wordline once its die is free */
+static bool slc_fold_idle(struct conv_ftl *conv_ftl, uint64_t now)
+{
+	struct conv_slc_cache *slc = &conv_ftl->slc;
+
+	if (slc->nr_cached == 0 ||
+		get_lun(conv_ftl->ssd, &slc->fold_q[slc->head].ppa)->next_lun_avail_time > now)
+		return false;
+
+	slc_fold_one(conv_ftl, now);
+	return true;
+}
+
+/* program a full host wordline, through the SLC cache if there is one */
+static uint64_t host_program_wordline(struct conv_ftl *conv_ftl, struct nand_cmd *swr)
+{
+	struct conv_slc_cache *slc = &conv_ftl->slc;
+	uint64_t nsecs_completed;
+
+	if (slc->capacity == 0)
+		return ssd_advance_nand(conv_ftl->ssd, swr);
+
+	if (slc->nr_cached == slc->capacity) {
+		slc->forced++;
+		slc_fold_one(conv_ftl, swr->stime);
+	}
+
+	/* the SLC blocks of the same die take the data */
+	swr->cmd = NAND_SLC_WRITE;
+	nsecs_completed = ssd_advance_nand(conv_ftl->ssd, swr);
+	swr->cmd = NAND_WRITE;
+
+	slc->fold_q[(slc->head + slc->nr_cached) % slc->capacity] = (struct conv_slc_wl){
+		.ppa = *swr->ppa,
+		.erase_cnt = get_blk(conv_ftl->ssd, swr->ppa)->erase_cnt,
+	};
+	slc->nr_cached++;
+	slc->written++;
+
+	return nsecs_completed;
+}
+
+/*
+ * Translation pages are spread over the dies of the partition, then over
+ * the flash pages and blocks of each die, so map I/O sees the same mix of
+ * page types as the data. Only the die and the page type are timed, no
+ * page state is touched.
+ */
+static struct ppa map_seg_ppa(struct conv_ftl *conv_ftl, uint32_t idx)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct ppa ppa = { .ppa = 0 };
+
+	ppa.g.ch = idx % spp->nchs;
+	idx /= spp->nchs;
+	ppa.g.lun = idx % spp->luns_per_ch;
+	idx /= spp->luns_per_ch;
+	ppa.g.pg = (idx % spp->flashpgs_per_blk) * spp->pgs_per_flashpg;
+	idx /= spp->flashpgs_per_blk;
+	ppa.g.blk = idx % spp->blks_per_pl;
+	return ppa;
+}
+
+/*
+ * Look up the mapping of local_lpn at stime, dirty for an update. Returns
+ * when the mapping is in DRAM.
+ */
+static uint64_t map_cache_access(struct conv_ftl *conv_ftl, uint64_t local_lpn, bool dirty, int io_type,
+								 uint64_t stime)
+{
+	struct conv_map_cache *mc = &conv_ftl->mc;
+	uint32_t seg = local_lpn / conv_ftl->cp.map_seg_lpns;
+	uint8_t set = MAP_SEG_REF | (dirty ? MAP_SEG_DIRTY : 0);
+	struct nand_cmd ncmd = {
+		.type = io_type,
+		.stime = stime,
+		.interleave_pci_dma = false,
+	};
+	uint32_t slot, victim;
+	struct ppa ppa;
+
+	if (mc->seg_state[seg] & MAP_SEG_CACHED) {
+		mc->seg_state[seg] |= set;
+		mc->hits++;
+		return stime;
+	}
+	mc->misses++;
+
+	if (mc->nr_cached < mc->nr_slots) {
+		slot = mc->nr_cached++;
+	} else {
+		/* referenced segments get a second chance */
+		while (mc->seg_state[mc->slot_seg[mc->hand]] & MAP_SEG_REF) {
+			mc->seg_state[mc->slot_seg[mc->hand]] &= ~MAP_SEG_REF;
+			mc->hand = (mc->hand + 1) % mc->nr_slots;
+		}
+		slot = mc->hand;
+		mc->hand = (mc->hand + 1) % mc->nr_slots;
+
+		victim = mc->slot_seg[slot];
+		if (mc->seg_state[victim] & MAP_SEG_DIRTY) {
+			mc->dirty_evicts++;
+			mc->wb_bytes += mc->seg_bytes;
+			if (mc->wb_bytes >= wordline_size(conv_ftl)) {
+				ppa = map_seg_ppa(conv_ftl, mc->wb_die++);
+				ncmd.cmd = NAND_WRITE;
+				ncmd.xfer_size = wordline_size(conv_ftl);
+				ncmd.true_size = ncmd.xfer_size;
+				ncmd.ppa = &ppa;
+				ssd_advance_nand(conv_ftl->ssd, &ncmd);
+				mc->wb_bytes -= wordline_size(conv_ftl);
+			}
+		}
+		mc->seg_state[victim] = 0;
+	}
+
+	mc->slot_seg[slot] = seg;
+	mc->seg_state[seg] = MAP_SEG_CACHED | set;
+
+	ppa = map_seg_ppa(conv_ftl, seg);
+	ncmd.cmd = NAND_READ;
+	ncmd.xfer_size = mc->seg_bytes;
+	ncmd.true_size = mc->seg_bytes;
+	ncmd.ppa = &ppa;
+	return ssd_advance_nand(conv_ftl->ssd, &ncmd);
+}
+
 static void conv_init_ftl(struct conv_ftl *conv_ftl, struct convparams *cpp, struct ssd *ssd)
 {
 	/*copy convparams*/
 	conv_ftl->cp = *cpp;
 
 	conv_ftl->ssd = ssd;
+	conv_ftl->shard = NULL;
+	mutex_init(&conv_ftl->lock);
+	conv_ftl->bg_gc_thread = NULL;
+	conv_ftl->last_host_io = 0;
+	conv_ftl->bg_gc_next = 0;
+	conv_ftl->bg_gc_paused = false;
+	memset(&conv_ftl->gc_cur, 0, sizeof(conv_ftl->gc_cur));
+	conv_ftl->gc_cur_busy = false;
+	conv_ftl->gc_debt = 0;
+	memset(conv_ftl->gc_stats, 0, sizeof(conv_ftl->gc_stats));
+	init_map_cache(conv_ftl);
+	mutex_init(&conv_ftl->ra.lock);
+	conv_ftl->ra.seq = 0;
+	memset(conv_ftl->ra.streams, 0, sizeof(conv_ftl->ra.streams));
 
-	
 	/* initialize maptbl */
 	NVMEV_INFO("initialize maptbl\n");
 	init_maptbl(conv_ftl); // mapping table
@@ -437,6 +961,7 @@ static void conv_init_ftl(struct conv_ftl *conv_ftl, struct convparams *cpp, str
 	/* initialize all the lines */
 	NVMEV_INFO("initialize lines\n");
 	init_lines(conv_ftl);
+	init_slc_cache(conv_ftl);
 
 	/* initialize write pointer, this is how we allocate new pages for writes */
 	NVMEV_INFO("initialize write pointer\n");
@@ -452,17 +977,36 @@ static void conv_init_ftl(struct conv_ftl *conv_ftl, struct convparams *cpp, str
 
 static void conv_remove_ftl(struct conv_ftl *conv_ftl)
 {
+	remove_map_cache(conv_ftl);
+	remove_slc_cache(conv_ftl);
 	remove_lines(conv_ftl);
 	remove_rmap(conv_ftl);
 	remove_maptbl(conv_ftl);
 }
 
-static void conv_init_params(struct convparams *cpp)
+static void conv_init_params(struct convparams *cpp, struct ssdparams *spp)
 {
 	cpp->op_area_pcent = OP_AREA_PERCENT;
 	cpp->gc_thres_lines = NR_MAX_RUH + 1; /* Need only two lines.(host write, gc)*/
 	cpp->gc_thres_lines_high = NR_MAX_RUH + 1; /* Need only two lines.(host write, gc)*/
 	cpp->enable_gc_delay = 1;
+	cpp->bg_gc_lines = vdev->config.bg_gc_lines;
+	cpp->bg_gc_idle_ns = (uint64_t)vdev->config.bg_gc_idle_us * 1000;
+	cpp->gc_incremental = vdev->config.gc_incremental;
+	cpp->gc_copy_ratio = vdev->config.gc_copy_ratio;
+	cpp->gc_streams = vdev->config.gc_streams;
+	if (cpp->gc_streams == GC_STREAM_RUH)
+		cpp->nr_gc_streams = NR_MAX_RUH;
+	else if (cpp->gc_streams == GC_STREAM_AGE)
+		cpp->nr_gc_streams = GC_AGE_CLASSES;
+	else
+		cpp->nr_gc_streams = 1;
+	cpp->ra_pgs = KB(vdev->config.read_ahead_kb) / spp->pgsz;
+	cpp->map_seg_lpns = KB(vdev->config.map_seg_kb) / CONV_MAP_ENTRY_SIZE;
+	cpp->map_cache_segs = KB((uint64_t)vdev->config.map_cache_kb) / SSD_PARTITIONS / KB(vdev->config.map_seg_kb);
+	if (vdev->config.map_cache_kb > 0 && cpp->map_cache_segs == 0)
+		cpp->map_cache_segs = 1;
+	cpp->slc_lines = vdev->config.slc_lines;
 	cpp->pba_pcent = (int)((1 + cpp->op_area_pcent) * 100);
 }
 
@@ -476,7 +1020,7 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 	const uint32_t nr_parts = SSD_PARTITIONS;
 
 	ssd_init_params(&spp, size, nr_parts);
-	conv_init_params(&cpp);
+	conv_init_params(&cpp, &spp);
 
 	conv_ftls = kmalloc_node(sizeof(struct conv_ftl) * nr_parts, GFP_KERNEL, 1);
 
@@ -488,8 +1032,8 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 
 	/* PCIe, Write buffer are shared by all instances*/
 	for (i = 1; i < nr_parts; i++) {
-		vfree(conv_ftls[i].ssd->pcie->perf_model);
-		kfree(conv_ftls[i].ssd->pcie);
+		ssd_remove_pcie(conv_ftls[i].ssd->pcie);
+		buffer_remove(conv_ftls[i].ssd->write_buffer);
 		kfree(conv_ftls[i].ssd->write_buffer);
 
 		conv_ftls[i].ssd->pcie = conv_ftls[0].ssd->pcie;
@@ -505,6 +1049,10 @@ void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *
 	/*register io command handler*/
 	ns->proc_io_cmd = conv_proc_nvme_io_cmd;
 
+	/* without owner threads, background GC runs on threads of its own */
+	if ((vdev->config.nr_ftl_cpu == 0 || conv_init_shards(ns)) && (cpp.bg_gc_lines > 0 || cpp.slc_lines > 0))
+		conv_init_bg_gc(ns);
+
 	NVMEV_INFO("FTL physical space: %lld, logical space: %lld (physical/logical * 100 = %d)\n", size, ns->size,
 			   cpp.pba_pcent);
 
@@ -543,6 +1091,9 @@ void conv_remove_namespace(struct nvmev_ns *ns)
 	const uint32_t nr_parts = SSD_PARTITIONS;
 	uint32_t i;
 
+	conv_remove_shards(ns);
+	conv_remove_bg_gc(ns);
+
 	/* PCIe, Write buffer are shared by all instances*/
 	for (i = 1; i < nr_parts; i++) {
 		/*
@@ -607,18 +1158,15 @@ static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct line_mgmt *lm = &conv_ftl->lm;
-	struct nand_block *blk = NULL;
-	struct nand_page *pg = NULL;
+	struct nand_block *blk = get_blk(conv_ftl->ssd, ppa);
 	bool was_full_line = false;
 	struct line *line;
 
 	/* update corresponding page status */
-	pg = get_pg(conv_ftl->ssd, ppa);
-	NVMEV_ASSERT(pg->status == PG_VALID);
-	pg->status = PG_INVALID;
+	NVMEV_ASSERT(get_pg(conv_ftl->ssd, ppa).status == PG_VALID);
+	set_pg_invalid(blk, ppa->g.pg);
 
 	/* update corresponding block status */
-	blk = get_blk(conv_ftl->ssd, ppa);
 	NVMEV_ASSERT(blk->ipc >= 0 && blk->ipc < spp->pgs_per_blk);
 	blk->ipc++;
 	NVMEV_ASSERT(blk->vpc > 0 && blk->vpc <= spp->pgs_per_blk);
@@ -633,10 +1181,9 @@ static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	}
 	line->ipc++;
 	NVMEV_ASSERT(line->vpc > 0 && line->vpc <= spp->pgs_per_line);
-	/* Adjust the position of the victime line in the pq under over-writes */
-	if (line->pos) {
-		/* Note that line->vpc will be updated by this call */
-		pqueue_change_priority(lm->victim_line_pq, line->vpc - 1, line);
+	/* Move the victim line down a bucket under over-writes */
+	if (line->victim) {
+		victim_dec_vpc(lm, line);
 	} else {
 		line->vpc--;
 	}
@@ -645,33 +1192,33 @@ static void mark_page_invalid(struct conv_ftl *conv_ftl, struct ppa *ppa)
 		/* move line: "full" -> "victim" */
 		list_del_init(&line->entry);
 		lm->full_line_cnt--;
-		pqueue_insert(lm->victim_line_pq, line);
-		lm->victim_line_cnt++;
+		victim_insert(lm, line);
 	}
 }
 
 static void mark_page_valid(struct conv_ftl *conv_ftl, struct ppa *ppa, uint16_t ruh)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
-	struct nand_block *blk = NULL;
-	struct nand_page *pg = NULL;
+	struct nand_block *blk = get_blk(conv_ftl->ssd, ppa);
+	struct nand_page pg;
 	struct line *line;
 
+	/* allocated when the line was opened */
+	NVMEV_ASSERT(blk->pg_written);
+
 	/* update page status */
 	pg = get_pg(conv_ftl->ssd, ppa);
-	if (pg->status != PG_FREE) {
+	if (pg.status != PG_FREE) {
 		NVMEV_ERROR("BUG mark_page_valid: ppa(ch=%u lun=%u pl=%u blk=%u pg=%u) status=%d\n",
-					ppa->g.ch, ppa->g.lun, ppa->g.pl, ppa->g.blk, ppa->g.pg, pg->status);
+					ppa->g.ch, ppa->g.lun, ppa->g.pl, ppa->g.blk, ppa->g.pg, pg.status);
 		NVMEV_ERROR("  limits: nchs=%d luns=%d pls=%d blks=%d pgs=%d\n",
 					spp->nchs, spp->luns_per_ch, spp->pls_per_lun,
 					spp->blks_per_pl, spp->pgs_per_blk);
 	}
-	NVMEV_ASSERT(pg->status == PG_FREE);
-	pg->status = PG_VALID;
-	pg->ruh = ruh;
+	NVMEV_ASSERT(pg.status == PG_FREE);
+	set_pg_valid(blk, ppa->g.pg, ruh);
 
 	/* update corresponding block status */
-	blk = get_blk(conv_ftl->ssd, ppa);
 	NVMEV_ASSERT(blk->vpc >= 0 && blk->vpc < spp->pgs_per_blk);
 	blk->vpc++;
 
@@ -679,33 +1226,73 @@ static void mark_page_valid(struct conv_ftl *conv_ftl, struct ppa *ppa, uint16_t
 	line = get_line(conv_ftl, ppa);
 	NVMEV_ASSERT(line->vpc >= 0 && line->vpc < spp->pgs_per_line);
 	line->vpc++;
+	if (ruh < NR_MAX_RUH) {
+		line->ruh_mask |= BIT(ruh);
+		line->ruh_pgs[ruh]++;
+	}
 }
 
-static void mark_block_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
+/* mark_page_valid() for nr_pages consecutive pages of one block */
+static void mark_page_run_valid(struct conv_ftl *conv_ftl, struct ppa *ppa, uint32_t nr_pages, uint16_t ruh)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct nand_block *blk = get_blk(conv_ftl->ssd, ppa);
-	struct nand_page *pg = NULL;
-	int i;
+	struct line *line = get_line(conv_ftl, ppa);
+	uint32_t pg;
 
-	for (i = 0; i < spp->pgs_per_blk; i++) {
-		/* reset page status */
-		pg = &blk->pg[i];
-		NVMEV_ASSERT(pg->nsecs == spp->secs_per_pg);
-		pg->status = PG_FREE;
-		// Reset the RUH info
-		pg->ruh = -1;
+	NVMEV_ASSERT(blk->pg_written);
+	NVMEV_ASSERT(ppa->g.pg + nr_pages <= spp->pgs_per_blk);
+	for (pg = ppa->g.pg; pg < ppa->g.pg + nr_pages; pg++) {
+		NVMEV_ASSERT(!test_bit(pg, blk->pg_written));
+		set_pg_valid(blk, pg, ruh);
 	}
 
-	/* reset block status */
+	NVMEV_ASSERT(blk->vpc >= 0 && blk->vpc + nr_pages <= spp->pgs_per_blk);
+	blk->vpc += nr_pages;
+
+	NVMEV_ASSERT(line->vpc >= 0 && line->vpc + nr_pages <= spp->pgs_per_line);
+	line->vpc += nr_pages;
+	if (ruh < NR_MAX_RUH) {
+		line->ruh_mask |= BIT(ruh);
+		line->ruh_pgs[ruh] += nr_pages;
+	}
+}
+
+static void mark_block_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct nand_block *blk = get_blk(conv_ftl->ssd, ppa);
+
+	/* reset page status and RUH info */
 	NVMEV_ASSERT(blk->npgs == spp->pgs_per_blk);
+	reset_blk_pgs(blk);
+
+	/* reset block status */
 	blk->ipc = 0;
 	blk->vpc = 0;
 	blk->erase_cnt++;
+	blk->wp = 0;
+	blk->prog_etime = 0;
+}
+
+/* GC stream that takes a page of ruh relocated out of victim */
+static uint16_t gc_stream(struct conv_ftl *conv_ftl, struct line *victim, uint16_t ruh)
+{
+	switch (conv_ftl->cp.gc_streams) {
+	case GC_STREAM_RUH:
+		return ruh;
+	case GC_STREAM_AGE:
+		return min_t(uint32_t, victim->gc_gen, GC_AGE_CLASSES - 1);
+	default:
+		return 0;
+	}
 }
 
-/* move valid page data (already in DRAM) from victim line to a new page */
-static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, uint16_t ruh)
+/*
+ * move valid page data (already in DRAM) from victim line to a new page,
+ * nsecs_read is when the GC read of the page completed
+ */
+static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, uint16_t ruh, uint64_t nsecs_read)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct convparams *cpp = &conv_ftl->cp;
@@ -713,9 +1300,17 @@ static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, ui
 	uint64_t nsecs_completed = 0;
 	uint64_t completed_time = 0;
 	uint64_t lpn = get_rmap_ent(conv_ftl, old_ppa);
+	uint16_t stream = gc_stream(conv_ftl, get_line(conv_ftl, old_ppa), ruh);
 
 	NVMEV_ASSERT(valid_lpn(conv_ftl, lpn));
-	new_ppa = get_new_page(conv_ftl, 0, GC_IO);
+	new_ppa = get_new_page(conv_ftl, stream, GC_IO);
+	/* get_gc_thres_lines() keeps a free line for every GC stream, gc_begin() its page state */
+	if (!mapped_ppa(&new_ppa)) {
+		NVMEV_ERROR("No line for GC stream %u, lpn %llu would be lost\n", stream, lpn);
+		NVMEV_ASSERT(0);
+	}
+	get_line(conv_ftl, &new_ppa)->gc_gen = stream + 1;
+	conv_ftl->gc_stats[vdev->config.gc_policy].gc_pgs++;
 	/* update maptbl */
 	set_maptbl_ent(conv_ftl, lpn, &new_ppa);
 	/* update rmap */
@@ -726,10 +1321,14 @@ static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, ui
 	mark_page_valid(conv_ftl, &new_ppa, ruh);
 
 	/* need to advance the write pointer here */
-	advance_write_pointer(conv_ftl, 0, GC_IO);
+	advance_write_pointer(conv_ftl, stream, GC_IO);
 
 	if (cpp->enable_gc_delay) {
 		struct nand_cmd gcw;
+
+		if (conv_ftl->mc.nr_slots > 0)
+			map_cache_access(conv_ftl, lpn, true, GC_IO, nsecs_read);
+
 		gcw.type = GC_IO;
 		gcw.cmd = NAND_NOP;
 		gcw.stime = 0;
@@ -737,13 +1336,16 @@ static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, ui
 		gcw.ppa = &new_ppa;
 		if (last_pg_in_wordline(conv_ftl, &new_ppa)) {
 			gcw.cmd = NAND_WRITE;
-			gcw.xfer_size = spp->pgsz * spp->pgs_per_oneshotpg;
+			gcw.xfer_size = wordline_size(conv_ftl);
 		}
 
 		nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &gcw);
 		// enqueue_gc_io_req(0, completed_time, true, spp->pgsz);
 	}
 
+	if (last_pg_in_wordline(conv_ftl, &new_ppa))
+		mark_wordline_programmed(conv_ftl, &new_ppa, nsecs_completed);
+
 	/* advance per-ch gc_endtime as well */
 #if 0
 	new_ch = get_ch(conv_ftl, &new_ppa);
@@ -756,56 +1358,162 @@ static uint64_t gc_write_page(struct conv_ftl *conv_ftl, struct ppa *old_ppa, ui
 	return nsecs_completed;
 }
 
-static struct line *select_victim_line(struct conv_ftl *conv_ftl, bool force)
+/*
+ * The policies below only pick among lines with at most max_vpc valid
+ * pages, and return NULL if there is none.
+ */
+
+/* Sprite LFS cost-benefit: age * (1 - u) / 2u, with u the valid ratio */
+static struct line *select_victim_cost_benefit(struct conv_ftl *conv_ftl, int max_vpc)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct line_mgmt *lm = &conv_ftl->lm;
-	struct line *victim_line = NULL;
-
-	victim_line = pqueue_peek(lm->victim_line_pq);
-	if (!victim_line) {
-		return NULL;
-	}
-
-	if (!force && (victim_line->vpc > (spp->pgs_per_line / 8))) {
-		return NULL;
+	struct line *line, *best = NULL;
+	uint64_t score, best_score = 0;
+	size_t i;
+
+	for_each_victim_line(lm, i, line) {
+		uint64_t age = lm->close_seq - line->close_seq + 1;
+
+		if (line->vpc > max_vpc)
+			goto out;
+		if (line->vpc == 0)
+			return line;
+
+		/* age * (P - v) / v is twice that, the same ranking in integers */
+		score = age * (spp->pgs_per_line - line->vpc) / line->vpc;
+		if (!best || score > best_score) {
+			best = line;
+			best_score = score;
+		}
 	}
 
-	pqueue_pop(lm->victim_line_pq);
-	victim_line->pos = 0;
-	lm->victim_line_cnt--;
-
-	/* victim_line is a danggling node now */
-	return victim_line;
+out:
+	return best;
 }
 
-/* here ppa identifies the block we want to clean */
-static uint64_t clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa, int *ret_cnt, uint32_t *valid_ruh,
-								  uint32_t *invalid_ruh)
+/* greedy over the GC_WINDOW_LINES least recently closed lines */
+static struct line *select_victim_windowed(struct conv_ftl *conv_ftl, int max_vpc)
 {
-	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct line *window[GC_WINDOW_LINES];
+	struct line *line, *best = NULL;
+	int nr = 0, j;
+	size_t i;
+
+	/* window[] is kept sorted by close_seq, oldest first */
+	for_each_victim_line(lm, i, line) {
+		if (line->vpc > max_vpc)
+			goto out;
+		if (nr == GC_WINDOW_LINES && line->close_seq >= window[nr - 1]->close_seq)
+			continue;
+		if (nr < GC_WINDOW_LINES)
+			nr++;
+		for (j = nr - 1; j > 0 && window[j - 1]->close_seq > line->close_seq; j--)
+			window[j] = window[j - 1];
+		window[j] = line;
+	}
+
+out:
+	for (j = 0; j < nr; j++) {
+		if (!best || window[j]->vpc < best->vpc)
+			best = window[j];
+	}
+
+	return best;
+}
+
+/*
+ * Lines holding a single RUH are preferred as long as they are not much
+ * worse than the greedy choice, so mixed lines left behind by GC get
+ * reclaimed too.
+ */
+static struct line *select_victim_ruh_aware(struct conv_ftl *conv_ftl, int max_vpc)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct line *greedy = victim_peek(lm);
+	struct line *line, *best = NULL;
+	size_t i;
+
+	if (greedy->vpc > max_vpc)
+		return NULL;
+
+	for_each_victim_line(lm, i, line) {
+		if (line->vpc > max_vpc)
+			goto out;
+		if (hweight32(line->ruh_mask) != 1)
+			continue;
+		if (!best || line->vpc < best->vpc)
+			best = line;
+	}
+
+out:
+	if (best && best->vpc <= greedy->vpc + spp->pgs_per_line / 8)
+		return best;
+	return greedy;
+}
+
+static struct line *select_victim_line(struct conv_ftl *conv_ftl, bool force)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct line *victim_line = NULL;
+	/* unless forced, only lines that are mostly invalid are worth collecting */
+	int max_vpc = force ? spp->pgs_per_line : spp->pgs_per_line / 8;
+
+	if (lm->victim_line_cnt == 0)
+		return NULL;
+
+	switch (vdev->config.gc_policy) {
+	case GC_POLICY_COST_BENEFIT:
+		victim_line = select_victim_cost_benefit(conv_ftl, max_vpc);
+		break;
+	case GC_POLICY_WINDOWED:
+		victim_line = select_victim_windowed(conv_ftl, max_vpc);
+		break;
+	case GC_POLICY_RUH_AWARE:
+		victim_line = select_victim_ruh_aware(conv_ftl, max_vpc);
+		break;
+	case GC_POLICY_GREEDY:
+	default:
+		victim_line = victim_peek(lm);
+		if (victim_line->vpc > max_vpc)
+			victim_line = NULL;
+		break;
+	}
+
+	if (!victim_line)
+		return NULL;
+
+	victim_remove(lm, victim_line);
+
+	/* victim_line is a danggling node now */
+	return victim_line;
+}
+
+/*
+ * here ppa identifies the die and flash page we want to clean, on all of
+ * its planes with one multi-plane read; only the valid pages are visited,
+ * through the blocks' pg_valid bitmaps
+ */
+static uint64_t clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa, int *ret_cnt, uint32_t *valid_ruh)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
 	struct convparams *cpp = &conv_ftl->cp;
-	struct nand_page *pg_iter = NULL;
-	int cnt = 0, i = 0;
-	uint64_t nsecs_completed, nsecs_latest = 0;
+	struct nand_block *blk;
+	uint32_t end = ppa->g.pg + spp->pgs_per_flashpg;
+	unsigned long pg;
+	int cnt = 0, pl;
+	uint64_t nsecs_completed, nsecs_read = 0, nsecs_latest = 0;
 	struct ppa ppa_copy = *ppa;
 
-	for (i = 0; i < spp->pgs_per_flashpg; i++) {
-		pg_iter = get_pg(conv_ftl->ssd, &ppa_copy);
-		/* there shouldn't be any free page in victim blocks */
-		NVMEV_ASSERT(pg_iter->status != PG_FREE);
-		if (pg_iter->ruh >= NR_MAX_LEVEL) {
-			NVMEV_ERROR("Invalid RUH %d in GC clean\n", pg_iter->ruh);
-			NVMEV_ASSERT(0);
-		}
-		if (pg_iter->status == PG_VALID) {
-			valid_ruh[pg_iter->ruh]++;
+	for (pl = 0; pl < spp->pls_per_lun; pl++) {
+		ppa_copy.g.pl = pl;
+		blk = get_blk(conv_ftl->ssd, &ppa_copy);
+		pg = ppa->g.pg;
+		for_each_set_bit_from(pg, blk->pg_valid, end)
 			cnt++;
-		} else {
-			invalid_ruh[pg_iter->ruh]++;
-		}
-
-		ppa_copy.g.pg++;
 	}
 
 	ppa_copy = *ppa;
@@ -821,23 +1529,30 @@ static uint64_t clean_one_flashpg(struct conv_ftl *conv_ftl, struct ppa *ppa, in
 		gcr.xfer_size = spp->pgsz * cnt;
 		gcr.interleave_pci_dma = false;
 		gcr.ppa = &ppa_copy;
-		nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &gcr);
-		nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
+		nsecs_read = ssd_advance_nand(conv_ftl->ssd, &gcr);
+		nsecs_latest = (nsecs_read > nsecs_latest) ? nsecs_read : nsecs_latest;
 
 		// enqueue_gc_io_req(0, completed_time, false, spp->pgsz * cnt);
 	}
 
-	for (i = 0; i < spp->pgs_per_flashpg; i++) {
-		pg_iter = get_pg(conv_ftl->ssd, &ppa_copy);
+	for (pl = 0; pl < spp->pls_per_lun; pl++) {
+		ppa_copy.g.pl = pl;
+		blk = get_blk(conv_ftl->ssd, &ppa_copy);
+		pg = ppa->g.pg;
+		for_each_set_bit_from(pg, blk->pg_valid, end) {
+			uint8_t ruh = blk->pg_ruh[pg];
+
+			if (ruh >= NR_MAX_LEVEL) {
+				NVMEV_ERROR("Invalid RUH %d in GC clean\n", ruh);
+				NVMEV_ASSERT(0);
+			}
+			valid_ruh[ruh]++;
 
-		/* there shouldn't be any free page in victim blocks */
-		if (pg_iter->status == PG_VALID) {
 			/* delay the maptbl update until "write" happens */
-			nsecs_completed = gc_write_page(conv_ftl, &ppa_copy, pg_iter->ruh);
+			ppa_copy.g.pg = pg;
+			nsecs_completed = gc_write_page(conv_ftl, &ppa_copy, ruh, nsecs_read);
 			nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
 		}
-
-		ppa_copy.g.pg++;
 	}
 
 	*ret_cnt += cnt;
@@ -850,82 +1565,225 @@ static void mark_line_free(struct conv_ftl *conv_ftl, struct ppa *ppa)
 	struct line *line = get_line(conv_ftl, ppa);
 	line->ipc = 0;
 	line->vpc = 0;
+	line->ruh_mask = 0;
+	line->gc_gen = 0;
+	memset(line->ruh_pgs, 0, sizeof(line->ruh_pgs));
 	/* move this line to free line list */
 	list_add_tail(&line->entry, &lm->free_line_list);
 	lm->free_line_cnt++;
 }
 
-static int do_gc(struct conv_ftl *conv_ftl, bool force)
+/* pick a victim and point cur at its first row */
+static bool gc_begin(struct conv_ftl *conv_ftl, struct conv_gc_cursor *cur, bool force)
 {
-	struct line *victim_line = NULL;
-	struct ssdparams *spp = &conv_ftl->ssd->sp;
-	struct convparams *cpp = &conv_ftl->cp;
-	struct nand_lun *lunp;
-	struct ppa ppa;
-	int ch, lun, flashpg;
+	struct line *victim_line;
 
-	victim_line = select_victim_line(conv_ftl, force);
-	if (!victim_line) {
-		return -1;
+	/* a victim takes at most one new line per GC stream */
+	if (reserve_free_lines(conv_ftl, conv_ftl->cp.nr_gc_streams)) {
+		NVMEV_ERROR("No memory for the GC destination lines, GC skipped\n");
+		return false;
 	}
 
-	ppa.g.blk = victim_line->id;
-	NVMEV_DEBUG("GC-ing line:%d,ipc=%d(%d),victim=%d,full=%d,free=%d\n", ppa.g.blk, victim_line->ipc, victim_line->vpc,
-				conv_ftl->lm.victim_line_cnt, conv_ftl->lm.full_line_cnt, conv_ftl->lm.free_line_cnt);
+	victim_line = select_victim_line(conv_ftl, force);
+	if (!victim_line)
+		return false;
+
+	NVMEV_DEBUG("GC-ing line:%d,ipc=%d(%d),victim=%d,full=%d,free=%d\n", victim_line->id, victim_line->ipc,
+				victim_line->vpc, conv_ftl->lm.victim_line_cnt, conv_ftl->lm.full_line_cnt,
+				conv_ftl->lm.free_line_cnt);
 
+	memset(cur, 0, sizeof(*cur));
+	cur->victim = victim_line;
 	conv_ftl->wfc.credits_to_refill = victim_line->ipc;
+	return true;
+}
 
-	uint32_t valid_ruh[NR_MAX_LEVEL] = {0};
-	uint32_t invalid_ruh[NR_MAX_LEVEL] = {0};
-
-	/* copy back valid data */
-	for (flashpg = 0; flashpg < spp->flashpgs_per_blk; flashpg++) {
-		ppa.g.pg = flashpg * spp->pgs_per_flashpg;
-		uint64_t nsecs_completed, nsecs_latest = 0;
-		int cnt = 0;
+/* first row at or after cur->flashpg with a valid page on any LUN, or the last row */
+static uint32_t gc_next_row(struct conv_ftl *conv_ftl, struct conv_gc_cursor *cur)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	uint32_t next = spp->flashpgs_per_blk - 1;
+	struct ppa ppa;
+	unsigned long pg;
+	int ch, lun, pl;
 
-		for (ch = 0; ch < spp->nchs; ch++) {
-			for (lun = 0; lun < spp->luns_per_ch; lun++) {
+	ppa.ppa = 0;
+	ppa.g.blk = cur->victim->id;
+	for (ch = 0; ch < spp->nchs; ch++) {
+		for (lun = 0; lun < spp->luns_per_ch; lun++) {
+			for (pl = 0; pl < spp->pls_per_lun; pl++) {
 				ppa.g.ch = ch;
 				ppa.g.lun = lun;
-				ppa.g.pl = 0;
-				lunp = get_lun(conv_ftl->ssd, &ppa);
-				nsecs_completed = clean_one_flashpg(conv_ftl, &ppa, &cnt, valid_ruh, invalid_ruh);
-				nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
+				ppa.g.pl = pl;
+				pg = find_next_bit(get_blk(conv_ftl->ssd, &ppa)->pg_valid, spp->pgs_per_blk,
+								   cur->flashpg * spp->pgs_per_flashpg);
+				next = min_t(uint32_t, next, pg / spp->pgs_per_flashpg);
+				if (next == cur->flashpg)
+					return next;
+			}
+		}
+	}
+
+	return next;
+}
+
+/*
+ * Copy back the valid pages of one flash-page row of the victim, i.e. the
+ * same flash page on every LUN, skipping rows without valid pages. The
+ * last row also erases the blocks and frees the line. Returns true once
+ * the victim is done.
+ */
+static bool gc_step(struct conv_ftl *conv_ftl, struct conv_gc_cursor *cur, int *nr_copied)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct convparams *cpp = &conv_ftl->cp;
+	uint32_t flashpg;
+	uint64_t nsecs_completed, nsecs_latest = 0;
+	struct nand_lun *lunp;
+	struct ppa ppa;
+	int ch, lun, pl, cnt = 0, i;
+
+	cur->flashpg = gc_next_row(conv_ftl, cur);
+	flashpg = cur->flashpg++;
+
+	ppa.ppa = 0;
+	ppa.g.blk = cur->victim->id;
+	ppa.g.pg = flashpg * spp->pgs_per_flashpg;
+
+	for (ch = 0; ch < spp->nchs; ch++) {
+		for (lun = 0; lun < spp->luns_per_ch; lun++) {
+			ppa.g.ch = ch;
+			ppa.g.lun = lun;
+			ppa.g.pl = 0;
+			lunp = get_lun(conv_ftl->ssd, &ppa);
+			nsecs_completed = clean_one_flashpg(conv_ftl, &ppa, &cnt, cur->valid_ruh);
+			nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
 
-				if (flashpg == (spp->flashpgs_per_blk - 1)) {
+			if (flashpg == (spp->flashpgs_per_blk - 1)) {
+				for (pl = 0; pl < spp->pls_per_lun; pl++) {
+					ppa.g.pl = pl;
 					mark_block_free(conv_ftl, &ppa);
+				}
+				ppa.g.pl = 0;
 
-					if (cpp->enable_gc_delay) {
-						struct nand_cmd gce;
-						gce.type = GC_IO;
-						gce.cmd = NAND_ERASE;
-						gce.stime = 0;
-						gce.interleave_pci_dma = false;
-						gce.ppa = &ppa;
-						ssd_advance_nand(conv_ftl->ssd, &gce);
-					}
-
-					lunp->gc_endtime = lunp->next_lun_avail_time;
+				/* multi-plane erase */
+				if (cpp->enable_gc_delay) {
+					struct nand_cmd gce;
+					gce.type = GC_IO;
+					gce.cmd = NAND_ERASE;
+					gce.stime = 0;
+					gce.interleave_pci_dma = false;
+					gce.ppa = &ppa;
+					ssd_advance_nand(conv_ftl->ssd, &gce);
 				}
+
+				lunp->gc_endtime = lunp->next_lun_avail_time;
 			}
 		}
+	}
 
+	if (cpp->enable_gc_delay)
 		enqueue_gc_io_req(0, nsecs_latest, true, spp->pgsz * cnt);
-	}
+
+	if (nr_copied)
+		*nr_copied = cnt;
+
+	if (flashpg < spp->flashpgs_per_blk - 1)
+		return false;
+
+	/* whatever was programmed and not copied was invalid */
+	for (i = 0; i < NR_MAX_RUH; i++)
+		cur->invalid_ruh[i] = cur->victim->ruh_pgs[i] - cur->valid_ruh[i];
 
 	/* update line status */
 	mark_line_free(conv_ftl, &ppa);
+	atomic64_add((uint64_t)spp->pgs_per_line * spp->pgsz, &vdev->media_erase);
 
 	NVMEV_FREEBIE_DEBUG("GC - valid[%u %u %u %u %u %u %u %u] invalid[%u %u %u %u %u %u %u %u]\n",
-		   valid_ruh[0], valid_ruh[1], valid_ruh[2], valid_ruh[3], valid_ruh[4], valid_ruh[5], valid_ruh[6], valid_ruh[7],
-		   invalid_ruh[0], invalid_ruh[1], invalid_ruh[2], invalid_ruh[3], invalid_ruh[4], invalid_ruh[5], invalid_ruh[6], invalid_ruh[7]);
+		   cur->valid_ruh[0], cur->valid_ruh[1], cur->valid_ruh[2], cur->valid_ruh[3], cur->valid_ruh[4],
+		   cur->valid_ruh[5], cur->valid_ruh[6], cur->valid_ruh[7], cur->invalid_ruh[0], cur->invalid_ruh[1],
+		   cur->invalid_ruh[2], cur->invalid_ruh[3], cur->invalid_ruh[4], cur->invalid_ruh[5],
+		   cur->invalid_ruh[6], cur->invalid_ruh[7]);
+
+	cur->victim = NULL;
+	return true;
+}
+
+/* collect a whole victim line in one go */
+static int do_gc(struct conv_ftl *conv_ftl, bool force)
+{
+	struct conv_gc_cursor cur;
+
+	if (!gc_begin(conv_ftl, &cur, force))
+		return -1;
+
+	while (!gc_step(conv_ftl, &cur, NULL))
+		;
 
 	return 0;
 }
 
+/*
+ * conv_ftl->gc_cur is the victim being collected incrementally, by host
+ * writes paying off their copy debt or by background GC. gc_cur_busy
+ * guards it against GC that nests from the GC write pointer running out
+ * of lines; the nested GC then collects another victim in one go.
+ */
+static bool gc_cur_step(struct conv_ftl *conv_ftl, int *nr_copied)
+{
+	bool done;
+
+	conv_ftl->gc_cur_busy = true;
+	done = gc_step(conv_ftl, &conv_ftl->gc_cur, nr_copied);
+	conv_ftl->gc_cur_busy = false;
+
+	if (done)
+		conv_ftl->gc_debt = 0;
+	return done;
+}
+
+static void gc_cur_finish(struct conv_ftl *conv_ftl)
+{
+	if (conv_ftl->gc_cur_busy)
+		return;
+
+	while (conv_ftl->gc_cur.victim && !gc_cur_step(conv_ftl, NULL))
+		;
+}
+
+static bool gc_cur_begin(struct conv_ftl *conv_ftl, bool force)
+{
+	struct conv_gc_cursor *cur = &conv_ftl->gc_cur;
+	uint32_t ratio = conv_ftl->cp.gc_copy_ratio;
+
+	if (!gc_begin(conv_ftl, cur, force))
+		return false;
+
+	/* by default, spread the copies evenly over the credits the victim gives back */
+	if (ratio == 0)
+		ratio = DIV_ROUND_UP(cur->victim->vpc * 100, max(cur->victim->ipc, 1));
+	cur->copy_ratio = ratio;
+	conv_ftl->gc_debt = 0;
+	return true;
+}
+
+/* host pages were written: let the incremental GC copy its share */
+static void gc_pay_debt(struct conv_ftl *conv_ftl, uint32_t nr_pgs)
+{
+	int copied;
+
+	conv_ftl->gc_debt += (int64_t)nr_pgs * conv_ftl->gc_cur.copy_ratio;
+	while (conv_ftl->gc_debt > 0 && conv_ftl->gc_cur.victim && !conv_ftl->gc_cur_busy) {
+		gc_cur_step(conv_ftl, &copied);
+		conv_ftl->gc_debt -= (int64_t)copied * 100;
+	}
+}
+
 static void forground_gc(struct conv_ftl *conv_ftl)
 {
+	/* a victim still being collected incrementally goes first */
+	gc_cur_finish(conv_ftl);
+
 	if (should_gc_high(conv_ftl)) {
 		NVMEV_DEBUG("should_gc_high passed");
 		/* perform GC here until !should_gc(conv_ftl) */
@@ -933,6 +1791,134 @@ static void forground_gc(struct conv_ftl *conv_ftl)
 	}
 }
 
+/*
+ * Credits ran out with incremental GC: the previous victim should be done
+ * by now (if not, it is finished here), and the next one is only started.
+ */
+static void incremental_gc(struct conv_ftl *conv_ftl)
+{
+	gc_cur_finish(conv_ftl);
+
+	if (should_gc_high(conv_ftl) && !conv_ftl->gc_cur_busy)
+		gc_cur_begin(conv_ftl, true);
+}
+
+/* host pages were programmed: GC accounting and write flow control */
+static void host_pgs_written(struct conv_ftl *conv_ftl, uint32_t nr_pgs)
+{
+	conv_ftl->gc_stats[vdev->config.gc_policy].host_pgs += nr_pgs;
+
+	if (conv_ftl->cp.gc_incremental && conv_ftl->gc_cur.victim)
+		gc_pay_debt(conv_ftl, nr_pgs);
+
+	conv_ftl->wfc.write_credits -= nr_pgs;
+	check_and_refill_write_credit(conv_ftl);
+}
+
+/* minimum gap between background GC victims while the host is active */
+#define BG_GC_BUSY_INTERVAL_NS (10ULL * 1000 * 1000)
+
+/*
+ * One round of background GC, at most one flash-page row of gc_cur.
+ * Below the soft threshold a new victim is started right away when the
+ * host is idle and at most every BG_GC_BUSY_INTERVAL_NS otherwise; an idle
+ * partition also reclaims cheap victims. Returns true if the caller should
+ * come back immediately, i.e. work was done while the host is idle.
+ */
+static bool conv_bg_gc_step(struct conv_ftl *conv_ftl)
+{
+	struct convparams *cpp = &conv_ftl->cp;
+	uint64_t now = nvmev_clock();
+	bool idle = now - READ_ONCE(conv_ftl->last_host_io) > cpp->bg_gc_idle_ns;
+
+	if (conv_ftl->bg_gc_paused)
+		return false;
+
+	/* an idle host lets the SLC cache drain before anything else */
+	if (idle && slc_fold_idle(conv_ftl, now))
+		return true;
+
+	if (cpp->bg_gc_lines == 0)
+		return false;
+
+	if (conv_ftl->gc_cur.victim) {
+		gc_cur_step(conv_ftl, NULL);
+		return idle;
+	}
+
+	if (conv_ftl->lm.free_line_cnt <= get_gc_thres_lines(conv_ftl) + cpp->bg_gc_lines) {
+		if (!idle && now < conv_ftl->bg_gc_next)
+			return false;
+
+		conv_ftl->bg_gc_next = now + BG_GC_BUSY_INTERVAL_NS;
+		return gc_cur_begin(conv_ftl, true) && idle;
+	}
+
+	return idle && gc_cur_begin(conv_ftl, false);
+}
+
+/*
+ * Keep background GC off the FTL while precondition or snapshot code
+ * rewrites it. Waiting on the lock lets a round in progress finish.
+ */
+static void conv_pause_bg_gc(struct nvmev_ns *ns, bool pause)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		mutex_lock(&conv_ftls[i].lock);
+		conv_ftls[i].bg_gc_paused = pause;
+		mutex_unlock(&conv_ftls[i].lock);
+	}
+}
+
+static int conv_bg_gc_worker(void *data)
+{
+	struct conv_ftl *conv_ftl = data;
+	bool reclaimed;
+
+	while (!kthread_should_stop()) {
+		mutex_lock(&conv_ftl->lock);
+		reclaimed = conv_bg_gc_step(conv_ftl);
+		mutex_unlock(&conv_ftl->lock);
+
+		if (reclaimed)
+			cond_resched();
+		else
+			usleep_range(100, 200);
+	}
+
+	return 0;
+}
+
+static void conv_init_bg_gc(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		conv_ftls[i].bg_gc_thread = kthread_run(conv_bg_gc_worker, &conv_ftls[i], "nvmev_bg_gc_%u_%u", ns->id, i);
+		if (IS_ERR(conv_ftls[i].bg_gc_thread)) {
+			NVMEV_ERROR("Failed to start background GC for partition %u\n", i);
+			conv_ftls[i].bg_gc_thread = NULL;
+		}
+	}
+}
+
+static void conv_remove_bg_gc(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		if (conv_ftls[i].bg_gc_thread) {
+			kthread_stop(conv_ftls[i].bg_gc_thread);
+			conv_ftls[i].bg_gc_thread = NULL;
+		}
+	}
+}
+
 static bool is_same_flash_page(struct conv_ftl *conv_ftl, struct ppa ppa1, struct ppa ppa2)
 {
 	struct ssdparams *spp = &conv_ftl->ssd->sp;
@@ -947,7 +1933,8 @@ bool pcie_rw(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result
 	struct nvme_command_csd *cmd = (struct nvme_command_csd *)(req->cmd);
 	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
 	struct conv_ftl *conv_ftl = &conv_ftls[0];
-	uint64_t nsecs_latest = ssd_advance_pcie(conv_ftl->ssd, req->nsecs_start, cmd->memory.length);
+	int dir = cmd->common.opcode == nvme_cmd_memory_write ? PCIE_H2D : PCIE_D2H;
+	uint64_t nsecs_latest = ssd_advance_pcie(conv_ftl->ssd, req->nsecs_start, cmd->memory.length, dir);
 
 	ret->nsecs_target = nsecs_latest;
 	ret->status = NVME_SC_SUCCESS;
@@ -1076,7 +2063,7 @@ bool get_partition_map (struct nvmev_ns *ns, struct nvmev_request *req, struct n
 
 		nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
 	}
-	nsecs_latest = ssd_advance_pcie(conv_ftl->ssd, nsecs_latest, chunk_count * FREEBIE_DATA_CHUNK_SIZE);
+	nsecs_latest = ssd_advance_pcie(conv_ftl->ssd, nsecs_latest, chunk_count * FREEBIE_DATA_CHUNK_SIZE, PCIE_D2H);
 
 	ret->nsecs_nand_start = srd.nand_stime;
 	ret->nsecs_target = nsecs_latest;
@@ -1085,105 +2072,578 @@ bool get_partition_map (struct nvmev_ns *ns, struct nvmev_request *req, struct n
 }
 #endif
 
-bool conv_read (struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret)
-{
-	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
-	struct conv_ftl *conv_ftl = &conv_ftls[0];
-	/* spp are shared by all instances*/
-	struct ssdparams *spp = &conv_ftl->ssd->sp;
-
-	struct nvme_command *cmd = req->cmd;
-	uint64_t lba = cmd->rw.slba;
-	uint64_t nr_lba = (cmd->rw.length + 1);
-	uint64_t start_lpn = lba / spp->secs_per_pg;
-	uint64_t end_lpn = (lba + nr_lba - 1) / spp->secs_per_pg;
-	uint64_t lpn, local_lpn;
-	uint64_t nsecs_start = req->nsecs_start;
-	uint64_t nsecs_completed, nsecs_latest = nsecs_start;
-	uint32_t xfer_size, i;
-	uint32_t nr_parts = ns->nr_parts;
+/* LPNs looked up and grouped per pass of the read path */
+#define CONV_READ_BATCH (64)
 
-	struct ppa cur_ppa, prev_ppa;
-	struct nand_cmd srd;
-	srd.type = USER_IO;
-	srd.cmd = NAND_READ;
-	srd.stime = nsecs_start;
-	srd.true_size = LBA_TO_BYTE(nr_lba);
-	srd.nand_stime = 0;
-	srd.interleave_pci_dma = false;
+/*
+ * identifies the flash page that holds ppa; the same flash page on the
+ * other planes of the die shares it, as a multi-plane read costs one tR
+ */
+static inline uint64_t flashpg_key(struct conv_ftl *conv_ftl, struct ppa *ppa)
+{
+	struct ppa key = *ppa;
 
-	NVMEV_ASSERT(conv_ftls);
-	NVMEV_DEBUG("conv_read: start_lpn=%lld, len=%d, end_lpn=%ld", start_lpn, nr_lba, end_lpn);
-	if ((end_lpn / nr_parts) >= spp->tt_pgs) {
-		NVMEV_ERROR("conv_read: lpn passed FTL range(start_lpn=%lld,tt_pgs=%ld)\n", start_lpn, spp->tt_pgs);
-		return false;
-	}
+	key.g.pg -= key.g.pg % conv_ftl->ssd->sp.pgs_per_flashpg;
+	key.g.pl = 0;
+	return key.ppa;
+}
 
-	if (LBA_TO_BYTE(nr_lba) <= (KB(4))) {
-		srd.stime += spp->fw_4kb_rd_lat;
-	} else {
-		srd.stime += spp->fw_rd_lat;
-	}
+/*
+ * The LPNs of one partition are consecutive local LPNs, so they are looked
+ * up in batches with the maptbl range prefetched, and the pages of a batch
+ * are grouped by flash page. Each group costs one NAND read.
+ */
+static uint64_t __conv_read_part(struct conv_ftl *conv_ftl, struct conv_part_cmd *pcmd)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct nand_cmd *srd = &pcmd->ncmd;
+	uint64_t nsecs_completed, nsecs_latest = 0;
+	uint64_t local_lpn = pcmd->start_lpn / pcmd->nr_parts;
+	uint64_t nr_left = (pcmd->end_lpn - pcmd->start_lpn) / pcmd->nr_parts + 1;
+	uint64_t grp_key[CONV_READ_BATCH];
+	struct ppa grp_ppa[CONV_READ_BATCH];
+	uint32_t grp_pgs[CONV_READ_BATCH];
+	uint32_t nr_batch, nr_grps, i, g;
+	uint64_t map_ready = 0;
+	struct ppa ppa;
+	uint64_t key;
 
-	for (i = 0; (i < nr_parts) && (start_lpn <= end_lpn); i++, start_lpn++) {
-		conv_ftl = &conv_ftls[start_lpn % nr_parts];
-		xfer_size = 0;
-		prev_ppa = get_maptbl_ent(conv_ftl, start_lpn / nr_parts);
+	while (nr_left > 0) {
+		nr_batch = min_t(uint64_t, nr_left, CONV_READ_BATCH);
+		prefetch_range(&conv_ftl->maptbl[local_lpn], nr_batch * sizeof(maptbl_ent_t));
 
-		NVMEV_DEBUG("[%s] conv_ftl=%p, ftl_ins=%lld, local_lpn=%lld", __FUNCTION__, conv_ftl, lpn % nr_parts,
-					lpn / nr_parts);
+		/* the batch is looked up once its mapping segments are in DRAM */
+		if (conv_ftl->mc.nr_slots > 0) {
+			for (i = 0; i < nr_batch; i++)
+				map_ready = max(map_ready, map_cache_access(conv_ftl, local_lpn + i, false, USER_IO, srd->stime));
+			srd->stime = max(srd->stime, map_ready);
+		}
 
-		/* normal IO read path */
-		for (lpn = start_lpn; lpn <= end_lpn; lpn += nr_parts) {
-			local_lpn = lpn / nr_parts;
-			cur_ppa = get_maptbl_ent(conv_ftl, local_lpn);
-			if (!mapped_ppa(&cur_ppa) || !valid_ppa(conv_ftl, &cur_ppa)) {
-				NVMEV_DEBUG("lpn 0x%llx not mapped to valid ppa\n", local_lpn);
-				NVMEV_DEBUG("Invalid ppa,ch:%d,lun:%d,blk:%d,pl:%d,pg:%d\n", cur_ppa.g.ch, cur_ppa.g.lun, cur_ppa.g.blk,
-							cur_ppa.g.pl, cur_ppa.g.pg);
+		nr_grps = 0;
+		for (i = 0; i < nr_batch; i++) {
+			ppa = get_maptbl_ent(conv_ftl, local_lpn + i);
+			if (!mapped_ppa(&ppa) || !valid_ppa(conv_ftl, &ppa)) {
+				NVMEV_DEBUG("lpn 0x%llx not mapped to valid ppa\n", local_lpn + i);
+				nsecs_latest = max(nsecs_latest, srd->stime);
 				continue;
 			}
 
-			// aggregate read io in same flash page
-			if (mapped_ppa(&prev_ppa) && is_same_flash_page(conv_ftl, cur_ppa, prev_ppa)) {
-				xfer_size += spp->pgsz;
+			/* unflushed data is served from DRAM */
+			if (page_in_write_buffer(conv_ftl, &ppa, srd->stime)) {
+				nsecs_latest = max3(nsecs_latest, pcmd->nsecs_hit, map_ready);
 				continue;
 			}
 
-			if (xfer_size > 0) {
-				srd.xfer_size = xfer_size;
-				srd.ppa = &prev_ppa;
-				nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &srd);
-				nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
+			/* sequential data nearly always extends the last group */
+			key = flashpg_key(conv_ftl, &ppa);
+			if (nr_grps > 0 && grp_key[nr_grps - 1] == key) {
+				grp_pgs[nr_grps - 1]++;
+				continue;
+			}
+			for (g = 0; g < nr_grps; g++) {
+				if (grp_key[g] == key)
+					break;
+			}
+			if (g < nr_grps) {
+				grp_pgs[g]++;
+				continue;
 			}
 
-			xfer_size = spp->pgsz;
-			prev_ppa = cur_ppa;
+			grp_key[nr_grps] = key;
+			grp_ppa[nr_grps] = ppa;
+			grp_pgs[nr_grps] = 1;
+			nr_grps++;
 		}
 
-		// issue remaining io
-		if (xfer_size > 0) {
-			srd.xfer_size = xfer_size;
-			srd.ppa = &prev_ppa;
-			nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &srd);
-			nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
+		for (g = 0; g < nr_grps; g++) {
+			srd->xfer_size = grp_pgs[g] * spp->pgsz;
+			srd->ppa = &grp_ppa[g];
+			nsecs_completed = ssd_advance_nand(conv_ftl->ssd, srd);
+			nsecs_latest = max(nsecs_latest, nsecs_completed);
 		}
-	}
-	if (srd.interleave_pci_dma == false) {
-		nsecs_latest = ssd_advance_pcie(conv_ftl->ssd, nsecs_latest, LBA_TO_BYTE(nr_lba));
+
+		local_lpn += nr_batch;
+		nr_left -= nr_batch;
 	}
 
-	ret->nsecs_nand_start = srd.nand_stime;
-	ret->nsecs_target = nsecs_latest;
-	ret->status = NVME_SC_SUCCESS;
-	return true;
+	return nsecs_latest;
 }
 
-/* RUH write statistics */
-static atomic64_t ruh_write_cnt[NR_MAX_RUH];
-static atomic64_t ruh_total_writes;
-
-bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret)
+static uint64_t __conv_write_part(struct conv_ftl *conv_ftl, struct conv_part_cmd *pcmd)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct buffer *wbuf = conv_ftl->ssd->write_buffer;
+	struct nand_cmd *swr = &pcmd->ncmd;
+	uint64_t nsecs_completed, nsecs_latest = swr->stime;
+	uint64_t lpn = pcmd->start_lpn, local_lpn;
+	uint32_t nr_left, nr_run, i;
+	struct ppa ppa, old_ppa;
+
+	/*
+	 * Pages are taken in runs that stay within one flash page, so the
+	 * block/line bookkeeping and write pointer update happen once per run.
+	 * Runs also stop where the write credits run out so that GC still
+	 * kicks in at the same point as with page-by-page allocation.
+	 */
+	while (lpn <= pcmd->end_lpn) {
+		nr_left = (pcmd->end_lpn - lpn) / pcmd->nr_parts + 1;
+		nr_run = get_new_page_run(conv_ftl, pcmd->ruh, USER_IO, min(nr_left, conv_ftl->wfc.write_credits), &ppa);
+		if (nr_run == 0) {
+			pcmd->nr_failed = nr_left;
+			break;
+		}
+
+		for (i = 0; i < nr_run; i++, lpn += pcmd->nr_parts) {
+			local_lpn = lpn / pcmd->nr_parts;
+			/* the update itself waits in DRAM, only the die time of the segment I/O is charged */
+			if (conv_ftl->mc.nr_slots > 0)
+				map_cache_access(conv_ftl, local_lpn, true, USER_IO, swr->stime);
+			old_ppa = get_maptbl_ent(conv_ftl, local_lpn); // 현재 LPN에 대해 전에 이미 쓰인 PPA가 있는지 확인
+			if (mapped_ppa(&old_ppa)) {
+				/* update old page information first */
+				mark_page_invalid(conv_ftl, &old_ppa);
+				set_rmap_ent(conv_ftl, INVALID_LPN, &old_ppa);
+			}
+
+			set_maptbl_ent(conv_ftl, local_lpn, &ppa);
+			set_rmap_ent(conv_ftl, local_lpn, &ppa);
+			ppa.g.pg++;
+		}
+		ppa.g.pg -= nr_run;
+		NVMEV_DEBUG("conv_write: got new ppa %lld + %u, ", ppa2pgidx(conv_ftl, &ppa), nr_run);
+
+		mark_page_run_valid(conv_ftl, &ppa, nr_run, pcmd->ruh_tag);
+		advance_write_pointer_by(conv_ftl, pcmd->ruh, USER_IO, nr_run);
+
+		/* Aggregate write io in flash page */
+		ppa.g.pg += nr_run - 1;
+		if (last_pg_in_wordline(conv_ftl, &ppa)) {
+			swr->xfer_size = wordline_size(conv_ftl);
+			swr->ppa = &ppa;
+			nsecs_completed = host_program_wordline(conv_ftl, swr);
+			nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
+			mark_wordline_programmed(conv_ftl, &ppa, nsecs_completed);
+
+			atomic64_add(wordline_size(conv_ftl), &g_last_pg_in_wordline_bytes);
+			buffer_release_at(wbuf, nsecs_completed, wordline_size(conv_ftl));
+		}
+
+		host_pgs_written(conv_ftl, nr_run);
+	}
+
+	return nsecs_latest;
+}
+
+static void __conv_trim_part(struct conv_ftl *conv_ftl, struct conv_part_cmd *pcmd)
+{
+	uint64_t lpn, local_lpn;
+	struct ppa ppa;
+
+	for (lpn = pcmd->start_lpn; lpn <= pcmd->end_lpn; lpn += pcmd->nr_parts) {
+		local_lpn = lpn / pcmd->nr_parts;
+		ppa = get_maptbl_ent(conv_ftl, local_lpn);
+		if (!mapped_ppa(&ppa) || !valid_ppa(conv_ftl, &ppa))
+			continue;
+
+		/* update old page information first */
+		mark_page_invalid(conv_ftl, &ppa);
+		set_rmap_ent(conv_ftl, INVALID_LPN, &ppa);
+		ppa.ppa = UNMAPPED_PPA;
+		set_maptbl_ent(conv_ftl, local_lpn, &ppa);
+	}
+}
+
+static void __conv_run_part_cmd(struct conv_ftl *conv_ftl, struct conv_part_cmd *pcmd)
+{
+	WRITE_ONCE(conv_ftl->last_host_io, nvmev_clock());
+
+	switch (pcmd->opcode) {
+	case nvme_cmd_read:
+		pcmd->nsecs_latest = __conv_read_part(conv_ftl, pcmd);
+		break;
+	case nvme_cmd_write:
+		pcmd->nsecs_latest = __conv_write_part(conv_ftl, pcmd);
+		break;
+	case nvme_cmd_dsm:
+		__conv_trim_part(conv_ftl, pcmd);
+		break;
+	default:
+		NVMEV_ASSERT(0);
+	}
+}
+
+/* Multi-producer, single-consumer handoff to the partition owner */
+static void __shard_submit(struct conv_shard *shard, struct conv_part_cmd *pcmd)
+{
+	unsigned int tail;
+
+	for (;;) {
+		tail = atomic_read(&shard->tail);
+		if (tail - smp_load_acquire(&shard->head) >= CONV_SHARD_RING_SIZE) {
+			cpu_relax();
+			continue;
+		}
+		if (atomic_cmpxchg(&shard->tail, tail, tail + 1) == tail)
+			break;
+	}
+
+	smp_store_release(&shard->ring[tail % CONV_SHARD_RING_SIZE], pcmd);
+}
+
+static int conv_shard_worker(void *data)
+{
+	struct conv_shard *shard = data;
+	struct conv_part_cmd *pcmd;
+	unsigned int slot;
+
+	NVMEV_INFO("%s started on cpu %d (node %d)\n", shard->thread_name, smp_processor_id(),
+			   cpu_to_node(smp_processor_id()));
+
+	while (!kthread_should_stop()) {
+		slot = shard->head % CONV_SHARD_RING_SIZE;
+		pcmd = smp_load_acquire(&shard->ring[slot]);
+		if (!pcmd) {
+			bool reclaimed;
+
+			/* the owner doubles as the background GC thread */
+			mutex_lock(&shard->conv_ftl->lock);
+			reclaimed = conv_bg_gc_step(shard->conv_ftl);
+			mutex_unlock(&shard->conv_ftl->lock);
+			if (!reclaimed)
+				cond_resched();
+			continue;
+		}
+
+		WRITE_ONCE(shard->ring[slot], NULL);
+		smp_store_release(&shard->head, shard->head + 1);
+
+		/* uncontended unless the FTL is being preconditioned */
+		mutex_lock(&shard->conv_ftl->lock);
+		__conv_run_part_cmd(shard->conv_ftl, pcmd);
+		mutex_unlock(&shard->conv_ftl->lock);
+
+		smp_mb__before_atomic();
+		atomic_dec(pcmd->pending);
+	}
+
+	return 0;
+}
+
+/* all partitions get an owner or none does; on failure slices run inline */
+static int conv_init_shards(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	const unsigned int nr_cpus = vdev->config.nr_ftl_cpu;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		struct conv_shard *shard = kzalloc_node(sizeof(struct conv_shard), GFP_KERNEL, 1);
+
+		if (!shard)
+			goto fail;
+
+		shard->conv_ftl = &conv_ftls[i];
+		atomic_set(&shard->tail, 0);
+		snprintf(shard->thread_name, sizeof(shard->thread_name), "nvmev_ftl_%u_%u", ns->id, i);
+
+		shard->thread = kthread_create(conv_shard_worker, shard, "%s", shard->thread_name);
+		if (IS_ERR(shard->thread)) {
+			kfree(shard);
+			goto fail;
+		}
+		kthread_bind(shard->thread, vdev->config.cpu_nr_ftl[i % nr_cpus]);
+		conv_ftls[i].shard = shard;
+		wake_up_process(shard->thread);
+	}
+
+	return 0;
+
+fail:
+	NVMEV_ERROR("Failed to start the owner thread of partition %u, running slices inline\n", i);
+	conv_remove_shards(ns);
+	return -ENOMEM;
+}
+
+static void conv_remove_shards(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		struct conv_shard *shard = conv_ftls[i].shard;
+
+		if (!shard)
+			continue;
+
+		if (!IS_ERR_OR_NULL(shard->thread))
+			kthread_stop(shard->thread);
+		kfree(shard);
+		conv_ftls[i].shard = NULL;
+	}
+}
+
+/*
+ * Host commands are split into one conv_part_cmd per partition they touch.
+ * Without FTL owner threads the slices run inline on the dispatcher;
+ * otherwise each slice is handed to the thread that owns the partition,
+ * so a partition's FTL state is only ever touched by one core.
+ *
+ * Split [start_lpn, end_lpn] over the partitions and run the slices. pcmds
+ * must hold ns->nr_parts entries and have opcode, sq_id, ruh and ncmd filled
+ * in. Returns the number of slices.
+ */
+static uint32_t __conv_run_parts(struct nvmev_ns *ns, struct conv_part_cmd *pcmds, uint64_t start_lpn,
+								 uint64_t end_lpn)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t nr_parts = ns->nr_parts;
+	uint32_t i, nr = min_t(uint64_t, nr_parts, end_lpn - start_lpn + 1);
+	atomic_t pending;
+
+	atomic_set(&pending, nr);
+
+	for (i = 0; i < nr; i++) {
+		struct conv_part_cmd *pcmd = &pcmds[i];
+
+		if (i > 0) {
+			pcmd->opcode = pcmds[0].opcode;
+			pcmd->sq_id = pcmds[0].sq_id;
+			pcmd->ruh = pcmds[0].ruh;
+			pcmd->ruh_tag = pcmds[0].ruh_tag;
+			pcmd->ncmd = pcmds[0].ncmd;
+			pcmd->nsecs_hit = pcmds[0].nsecs_hit;
+		}
+		pcmd->start_lpn = start_lpn + i;
+		pcmd->end_lpn = end_lpn;
+		pcmd->nr_parts = nr_parts;
+		pcmd->nsecs_latest = pcmd->ncmd.stime;
+		pcmd->nr_failed = 0;
+		pcmd->pending = &pending;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct conv_ftl *conv_ftl = &conv_ftls[(start_lpn + i) % nr_parts];
+
+		if (conv_ftl->shard) {
+			__shard_submit(conv_ftl->shard, &pcmds[i]);
+		} else {
+			mutex_lock(&conv_ftl->lock);
+			__conv_run_part_cmd(conv_ftl, &pcmds[i]);
+			mutex_unlock(&conv_ftl->lock);
+		}
+	}
+
+	if (conv_ftls[0].shard) {
+		while (atomic_read(&pending) > 0)
+			cpu_relax();
+		smp_rmb();
+	}
+
+	return nr;
+}
+
+/*
+ * Read-ahead. A read that starts where a stream left off continues it, and
+ * once a stream has made CONV_RA_TRIGGER reads in a row, reaching the end
+ * of its window reads the next ra_pgs LPNs into DRAM. Reads that fall in a
+ * window are served from there. Returns true on such a hit, with the time
+ * the data is in DRAM; *fetch is set to a stream whose next window the
+ * caller has to read with conv_ra_fetch().
+ */
+static bool conv_ra_lookup(struct conv_read_ahead *ra, uint32_t ra_pgs, uint64_t start_lpn, uint64_t end_lpn,
+						   uint64_t *nsecs_ready, struct conv_ra_stream **fetch, uint64_t *fetch_id)
+{
+	struct conv_ra_stream *s, *lru = &ra->streams[0];
+	bool hit = false;
+	int i;
+
+	mutex_lock(&ra->lock);
+	for (i = 0; i < CONV_RA_STREAMS; i++) {
+		s = &ra->streams[i];
+		if (s->seq_cnt > 0 && s->next_lpn == start_lpn)
+			break;
+		if (start_lpn >= s->ra_start && end_lpn < s->ra_end)
+			break;
+		if (s->last_used < lru->last_used)
+			lru = s;
+	}
+
+	if (i == CONV_RA_STREAMS) {
+		/* a new stream takes the least recently used slot */
+		s = lru;
+		*s = (struct conv_ra_stream){ .id = ++ra->seq };
+	} else if (start_lpn >= s->ra_start && end_lpn < s->ra_end) {
+		*nsecs_ready = s->ra_ready;
+		hit = true;
+	}
+
+	if (s->next_lpn != start_lpn)
+		s->seq_cnt = 0;
+	s->next_lpn = end_lpn + 1;
+	s->seq_cnt++;
+	s->last_used = ++ra->seq;
+
+	*fetch = NULL;
+	if (s->seq_cnt >= CONV_RA_TRIGGER && s->next_lpn >= s->ra_end && !s->fetching) {
+		s->fetching = true;
+		s->fetch_stale = false;
+		s->fetch_start = s->next_lpn;
+		s->fetch_end = s->next_lpn + ra_pgs;
+		*fetch = s;
+		*fetch_id = s->id;
+	}
+	mutex_unlock(&ra->lock);
+
+	return hit;
+}
+
+/*
+ * Read the window that follows the stream into DRAM. It is charged to the
+ * dies inline, right behind the read that triggered it, so its time shows
+ * up as die contention rather than on that read. Writes on other
+ * dispatchers may land in the window meanwhile; conv_ra_invalidate() then
+ * marks the fetch stale and the window is not installed.
+ */
+static void conv_ra_fetch(struct nvmev_ns *ns, struct conv_ra_stream *s, uint64_t id, uint64_t nsecs_start)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	struct conv_read_ahead *ra = &conv_ftls[0].ra;
+	struct ssdparams *spp = &conv_ftls[0].ssd->sp;
+	uint64_t max_lpn = (uint64_t)spp->tt_pgs * ns->nr_parts;
+	uint64_t start_lpn, end_lpn, nsecs_ready = nsecs_start;
+	struct conv_part_cmd pcmds[SSD_PARTITIONS];
+	struct nand_cmd *srd = &pcmds[0].ncmd;
+	uint32_t i, nr = 0;
+
+	/* the range is fixed at lookup, the stream itself may have moved on */
+	mutex_lock(&ra->lock);
+	start_lpn = s->fetch_start;
+	end_lpn = min(s->fetch_end, max_lpn) - 1;
+	mutex_unlock(&ra->lock);
+	if (start_lpn <= end_lpn) {
+		srd->type = USER_IO;
+		srd->cmd = NAND_READ;
+		srd->stime = nsecs_start;
+		srd->true_size = (end_lpn - start_lpn + 1) * spp->pgsz;
+		srd->nand_stime = 0;
+		srd->interleave_pci_dma = false;
+		pcmds[0].opcode = nvme_cmd_read;
+		pcmds[0].sq_id = 0;
+		pcmds[0].nsecs_hit = nsecs_start;
+
+		nr = __conv_run_parts(ns, pcmds, start_lpn, end_lpn);
+	}
+	for (i = 0; i < nr; i++)
+		nsecs_ready = max(nsecs_ready, pcmds[i].nsecs_latest);
+
+	mutex_lock(&ra->lock);
+	if (s->id == id) {
+		s->fetching = false;
+		if (nr > 0 && !s->fetch_stale) {
+			s->ra_start = start_lpn;
+			s->ra_end = end_lpn + 1;
+			s->ra_ready = nsecs_ready;
+		}
+	}
+	mutex_unlock(&ra->lock);
+}
+
+/* written or trimmed LPNs make the read-ahead data that covers them stale */
+static void conv_ra_invalidate(struct conv_read_ahead *ra, uint64_t start_lpn, uint64_t end_lpn)
+{
+	struct conv_ra_stream *s;
+	int i;
+
+	mutex_lock(&ra->lock);
+	for (i = 0; i < CONV_RA_STREAMS; i++) {
+		s = &ra->streams[i];
+		if (start_lpn < s->ra_end && end_lpn >= s->ra_start)
+			s->ra_end = s->ra_start;
+		if (s->fetching && start_lpn < s->fetch_end && end_lpn >= s->fetch_start)
+			s->fetch_stale = true;
+	}
+	mutex_unlock(&ra->lock);
+}
+
+bool conv_read (struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	struct conv_ftl *conv_ftl = &conv_ftls[0];
+	/* spp are shared by all instances*/
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+
+	struct nvme_command *cmd = req->cmd;
+	uint64_t lba = cmd->rw.slba;
+	uint64_t nr_lba = (cmd->rw.length + 1);
+	uint64_t start_lpn = lba / spp->secs_per_pg;
+	uint64_t end_lpn = (lba + nr_lba - 1) / spp->secs_per_pg;
+	uint64_t nsecs_start = req->nsecs_start;
+	uint64_t nsecs_latest = nsecs_start;
+	uint64_t nsecs_nand_start = 0;
+	uint64_t nsecs_ready, fetch_id;
+	uint32_t nr_parts = ns->nr_parts;
+	uint32_t i, nr;
+	struct conv_ra_stream *fetch = NULL;
+	bool ra_hit = false;
+
+	struct conv_part_cmd pcmds[SSD_PARTITIONS];
+	struct nand_cmd *srd = &pcmds[0].ncmd;
+	srd->type = USER_IO;
+	srd->cmd = NAND_READ;
+	srd->stime = nsecs_start;
+	srd->true_size = LBA_TO_BYTE(nr_lba);
+	srd->nand_stime = 0;
+	srd->interleave_pci_dma = false;
+	pcmds[0].opcode = nvme_cmd_read;
+	pcmds[0].sq_id = req->sq_id;
+	pcmds[0].nsecs_hit = nsecs_start + spp->fw_cache_rd_lat;
+
+	NVMEV_ASSERT(conv_ftls);
+	NVMEV_DEBUG("conv_read: start_lpn=%lld, len=%d, end_lpn=%ld", start_lpn, nr_lba, end_lpn);
+	if ((end_lpn / nr_parts) >= spp->tt_pgs) {
+		NVMEV_ERROR("conv_read: lpn passed FTL range(start_lpn=%lld,tt_pgs=%ld)\n", start_lpn, spp->tt_pgs);
+		return false;
+	}
+
+	if (LBA_TO_BYTE(nr_lba) <= (KB(4))) {
+		srd->stime += spp->fw_4kb_rd_lat;
+	} else {
+		srd->stime += spp->fw_rd_lat;
+	}
+
+	if (conv_ftl->cp.ra_pgs > 0)
+		ra_hit = conv_ra_lookup(&conv_ftl->ra, conv_ftl->cp.ra_pgs, start_lpn, end_lpn, &nsecs_ready, &fetch,
+							 &fetch_id);
+
+	if (ra_hit) {
+		nsecs_latest = max(pcmds[0].nsecs_hit, nsecs_ready);
+	} else {
+		nr = __conv_run_parts(ns, pcmds, start_lpn, end_lpn);
+		for (i = 0; i < nr; i++) {
+			nsecs_latest = max(nsecs_latest, pcmds[i].nsecs_latest);
+			nsecs_nand_start = max(nsecs_nand_start, pcmds[i].ncmd.nand_stime);
+		}
+	}
+
+	/* the read-ahead queues behind the read that triggered it */
+	if (fetch)
+		conv_ra_fetch(ns, fetch, fetch_id, srd->stime);
+
+	if (srd->interleave_pci_dma == false) {
+		nsecs_latest = ssd_advance_pcie(conv_ftl->ssd, nsecs_latest, LBA_TO_BYTE(nr_lba), PCIE_D2H);
+	}
+
+	ret->nsecs_nand_start = nsecs_nand_start;
+	ret->nsecs_target = nsecs_latest;
+	ret->status = NVME_SC_SUCCESS;
+	return true;
+}
+
+/* RUH write statistics */
+static atomic64_t ruh_write_cnt[NR_MAX_RUH];
+static atomic64_t ruh_total_writes;
+
+bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret)
 {
 	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
 	struct conv_ftl *conv_ftl = &conv_ftls[0];
@@ -1198,13 +2658,12 @@ bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_res
 	uint64_t start_lpn = lba / spp->secs_per_pg;
 	uint64_t end_lpn = (lba + nr_lba - 1) / spp->secs_per_pg;
 
-	uint64_t lpn, local_lpn;
 	uint32_t nr_parts = ns->nr_parts;
+	uint32_t i, nr, nr_failed = 0;
 
 	uint64_t nsecs_start = req->nsecs_start;
-	uint64_t nsecs_completed = 0, nsecs_latest;
+	uint64_t nsecs_latest;
 	uint64_t nsecs_xfer_completed;
-	uint32_t allocated_buf_size;
 
 	uint8_t dtype = (cmd->rw.control >> 4) & 0xF;
 	uint16_t ruh = (cmd->rw.dsmgmt) >> 16 & 0xFFFF;
@@ -1215,8 +2674,8 @@ bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_res
 		// return false;
 	}
 
-	struct ppa ppa;
-	struct nand_cmd swr;
+	struct conv_part_cmd pcmds[SSD_PARTITIONS];
+	struct nand_cmd *swr = &pcmds[0].ncmd;
 
 	NVMEV_ASSERT(conv_ftls);
 
@@ -1236,13 +2695,12 @@ bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_res
 		return false;
 	}
 
-	allocated_buf_size = buffer_allocate(wbuf, LBA_TO_BYTE(nr_lba));
+	if (conv_ftl->cp.ra_pgs > 0)
+		conv_ra_invalidate(&conv_ftl->ra, start_lpn, end_lpn);
 
-	if (allocated_buf_size < LBA_TO_BYTE(nr_lba)) {
-		NVMEV_ERROR("conv_write: buffer allocation failed (requested=%lld, allocated=%u)\n",
-			LBA_TO_BYTE(nr_lba), allocated_buf_size);
+	/* a full write buffer delays the write until writebacks free enough space */
+	if (!buffer_allocate(wbuf, LBA_TO_BYTE(nr_lba), &nsecs_start))
 		return false;
-	}
 
 	nsecs_latest = nsecs_start;
 	if (req->sq_id != 0xFFFFFFFF) {
@@ -1252,50 +2710,26 @@ bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_res
 	}
 	nsecs_xfer_completed = nsecs_latest;
 
-	swr.type = USER_IO;
-	swr.cmd = NAND_WRITE;
-	swr.stime = nsecs_latest;
-	swr.interleave_pci_dma = false;
-
-	for (lpn = start_lpn; lpn <= end_lpn; lpn++) {
-		conv_ftl = &conv_ftls[lpn % nr_parts];
-		local_lpn = lpn / nr_parts;
-		ppa = get_maptbl_ent(conv_ftl, local_lpn); // 현재 LPN에 대해 전에 이미 쓰인 PPA가 있는지 확인
-		if (mapped_ppa(&ppa)) {
-			/* update old page information first */
-			mark_page_invalid(conv_ftl, &ppa);
-			set_rmap_ent(conv_ftl, INVALID_LPN, &ppa);
-			NVMEV_DEBUG("conv_write: %lld is invalid, ", ppa2pgidx(conv_ftl, &ppa));
-		}
-
-		/* new write */
-		ppa = get_new_page(conv_ftl, ruh, USER_IO);
-		/* update maptbl */
-		set_maptbl_ent(conv_ftl, local_lpn, &ppa);
-		NVMEV_DEBUG("conv_write: got new ppa %lld, ", ppa2pgidx(conv_ftl, &ppa));
-		/* update rmap */
-		set_rmap_ent(conv_ftl, local_lpn, &ppa);
-
-		// increase_fdp_counter(ruh, USER_IO);
-
-		mark_page_valid(conv_ftl, &ppa, ruh_copy);
-
-		/* need to advance the write pointer here */
-		advance_write_pointer(conv_ftl, ruh, USER_IO);
-
-		/* Aggregate write io in flash page */
-		if (last_pg_in_wordline(conv_ftl, &ppa)) {
-			swr.xfer_size = spp->pgsz * spp->pgs_per_oneshotpg;
-			swr.ppa = &ppa;
-			nsecs_completed = ssd_advance_nand(conv_ftl->ssd, &swr);
-			nsecs_latest = (nsecs_completed > nsecs_latest) ? nsecs_completed : nsecs_latest;
+	swr->type = USER_IO;
+	swr->cmd = NAND_WRITE;
+	swr->stime = nsecs_latest;
+	swr->interleave_pci_dma = false;
+	pcmds[0].opcode = nvme_cmd_write;
+	pcmds[0].sq_id = req->sq_id;
+	pcmds[0].ruh = ruh;
+	pcmds[0].ruh_tag = ruh_copy;
 
-			atomic64_add(spp->pgs_per_oneshotpg * spp->pgsz, &g_last_pg_in_wordline_bytes);
-			enqueue_writeback_io_req(req->sq_id, nsecs_completed, wbuf, spp->pgs_per_oneshotpg * spp->pgsz);
-		}
+	nr = __conv_run_parts(ns, pcmds, start_lpn, end_lpn);
+	ret->status = NVME_SC_SUCCESS;
+	for (i = 0; i < nr; i++) {
+		nsecs_latest = max(nsecs_latest, pcmds[i].nsecs_latest);
+		nr_failed += pcmds[i].nr_failed;
+	}
 
-		consume_write_credit(conv_ftl);
-		check_and_refill_write_credit(conv_ftl);
+	if (nr_failed) {
+		/* unwritten pages never reach a wordline writeback, give their space back */
+		buffer_release(wbuf, min_t(uint64_t, (uint64_t)nr_failed * spp->pgsz, LBA_TO_BYTE(nr_lba)));
+		ret->status = NVME_SC_INTERNAL;
 	}
 
 	if ((cmd->rw.control & NVME_RW_FUA) || (spp->write_early_completion == 0)) {
@@ -1305,19 +2739,539 @@ bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_res
 		/* Early completion */
 		ret->nsecs_target = nsecs_xfer_completed;
 	}
-	ret->nsecs_nand_start = swr.stime;
-	ret->status = NVME_SC_SUCCESS;
+	ret->nsecs_nand_start = nsecs_xfer_completed;
 
 	return true;
 }
 
+/* metadata-only host write used for preconditioning, no NAND timing */
+static int __precond_write_page(struct conv_ftl *conv_ftl, uint64_t local_lpn, uint16_t ruh)
+{
+	struct ppa ppa = get_new_page(conv_ftl, ruh, USER_IO), old_ppa;
+
+	if (!mapped_ppa(&ppa))
+		return -ENOMEM;
+
+	old_ppa = get_maptbl_ent(conv_ftl, local_lpn);
+	if (mapped_ppa(&old_ppa)) {
+		mark_page_invalid(conv_ftl, &old_ppa);
+		set_rmap_ent(conv_ftl, INVALID_LPN, &old_ppa);
+	}
+
+	set_maptbl_ent(conv_ftl, local_lpn, &ppa);
+	set_rmap_ent(conv_ftl, local_lpn, &ppa);
+	mark_page_valid(conv_ftl, &ppa, ruh);
+	advance_write_pointer(conv_ftl, ruh, USER_IO);
+	if (last_pg_in_wordline(conv_ftl, &ppa))
+		mark_wordline_programmed(conv_ftl, &ppa, 0);
+
+	host_pgs_written(conv_ftl, 1);
+	return 0;
+}
+
+static inline int __precond_write_lpn(struct nvmev_ns *ns, uint64_t lpn, uint16_t ruh)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+
+	return __precond_write_page(&conv_ftls[lpn % ns->nr_parts], lpn / ns->nr_parts, ruh);
+}
+
+/*
+ * Take every partition for preconditioning. Slices, owner threads and the
+ * background GC all run under conv_ftl->lock, so holding them keeps the FTL
+ * to ourselves; a lock that is taken, or a slice still queued for an owner,
+ * means I/O is in flight.
+ */
+static int __precond_lock_parts(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		struct conv_shard *shard = conv_ftls[i].shard;
+
+		if (!mutex_trylock(&conv_ftls[i].lock))
+			goto busy;
+		if (shard && atomic_read(&shard->tail) != smp_load_acquire(&shard->head)) {
+			mutex_unlock(&conv_ftls[i].lock);
+			goto busy;
+		}
+	}
+
+	return 0;
+
+busy:
+	while (i--)
+		mutex_unlock(&conv_ftls[i].lock);
+	return -EBUSY;
+}
+
+/*
+ * Drive the mapping, line and write pointer state straight to the requested
+ * condition, as if the host had written it, but without any NAND/PCIe timing
+ * and without touching the data area. GC runs as needed with its delay model
+ * disabled. Fails with -EBUSY if I/O is in flight; I/O issued meanwhile waits
+ * until it is done.
+ */
+int conv_precondition(struct nvmev_ns *ns, struct conv_precond_spec *spec)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint64_t nr_lpns = ns->size / conv_ftls[0].ssd->sp.pgsz;
+	uint64_t range, lpn, nr_writes = 0, start = nvmev_clock();
+	uint64_t remaining[NR_MAX_RUH];
+	bool gc_delay[SSD_PARTITIONS];
+	uint32_t i, ruh;
+	bool pending;
+	int err = 0;
+
+	if (spec->fill_pcent == 0 || spec->fill_pcent > 100 || spec->nr_ruh == 0 || spec->nr_ruh > NR_MAX_RUH)
+		return -EINVAL;
+
+	nr_lpns = nr_lpns * spec->fill_pcent / 100;
+	range = nr_lpns / spec->nr_ruh;
+	if (range == 0)
+		return -EINVAL;
+
+	err = __precond_lock_parts(ns);
+	if (err)
+		return err;
+
+	for (i = 0; i < ns->nr_parts; i++) {
+		gc_delay[i] = conv_ftls[i].cp.enable_gc_delay;
+		conv_ftls[i].cp.enable_gc_delay = false;
+	}
+
+	/* sequential fill, RUH i owns the i-th range */
+	for (lpn = 0; lpn < range * spec->nr_ruh; lpn++) {
+		err = __precond_write_lpn(ns, lpn, lpn / range);
+		if (err)
+			goto out;
+		if ((++nr_writes % (1 << 20)) == 0)
+			cond_resched();
+	}
+
+	/* random overwrites, interleaved over the RUH ranges */
+	if (spec->mode == PRECOND_RAND) {
+		for (ruh = 0; ruh < spec->nr_ruh; ruh++)
+			remaining[ruh] = range * spec->overwrite_pcent[ruh] / 100;
+
+		do {
+			pending = false;
+			for (ruh = 0; ruh < spec->nr_ruh; ruh++) {
+				if (!remaining[ruh])
+					continue;
+
+				lpn = ruh * range + (get_random_u64() % range);
+				err = __precond_write_lpn(ns, lpn, ruh);
+				if (err)
+					goto out;
+				remaining[ruh]--;
+				pending = true;
+
+				if ((++nr_writes % (1 << 20)) == 0)
+					cond_resched();
+			}
+		} while (pending);
+	}
+
+out:
+	for (i = 0; i < ns->nr_parts; i++) {
+		struct line_mgmt *lm = &conv_ftls[i].lm;
+
+		conv_ftls[i].cp.enable_gc_delay = gc_delay[i];
+		NVMEV_INFO("precondition[%u]: free=%u victim=%u full=%u lines\n", i, lm->free_line_cnt,
+				   lm->victim_line_cnt, lm->full_line_cnt);
+		mutex_unlock(&conv_ftls[i].lock);
+	}
+	NVMEV_INFO("precondition: %llu page writes over %u RUH(s) in %llu ms\n", nr_writes, spec->nr_ruh,
+			   (nvmev_clock() - start) / 1000000);
+
+	return err;
+}
+
+void conv_gc_stats(struct nvmev_ns *ns, int policy, struct conv_gc_stat *stat)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	stat->host_pgs = 0;
+	stat->gc_pgs = 0;
+	for (i = 0; i < ns->nr_parts; i++) {
+		stat->host_pgs += READ_ONCE(conv_ftls[i].gc_stats[policy].host_pgs);
+		stat->gc_pgs += READ_ONCE(conv_ftls[i].gc_stats[policy].gc_pgs);
+	}
+}
+
+void conv_map_stats(struct nvmev_ns *ns, struct conv_map_stat *stat)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	stat->hits = 0;
+	stat->misses = 0;
+	stat->dirty_evicts = 0;
+	for (i = 0; i < ns->nr_parts; i++) {
+		stat->hits += READ_ONCE(conv_ftls[i].mc.hits);
+		stat->misses += READ_ONCE(conv_ftls[i].mc.misses);
+		stat->dirty_evicts += READ_ONCE(conv_ftls[i].mc.dirty_evicts);
+	}
+}
+
+void conv_slc_stats(struct nvmev_ns *ns, struct conv_slc_stat *stat)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	memset(stat, 0, sizeof(*stat));
+	for (i = 0; i < ns->nr_parts; i++) {
+		struct conv_slc_cache *slc = &conv_ftls[i].slc;
+
+		stat->nr_cached += READ_ONCE(slc->nr_cached);
+		stat->capacity += slc->capacity;
+		stat->written += READ_ONCE(slc->written);
+		stat->folded += READ_ONCE(slc->folded);
+		stat->dropped += READ_ONCE(slc->dropped);
+		stat->forced += READ_ONCE(slc->forced);
+	}
+}
+
+void conv_gc_stats_reset(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	uint32_t i;
+
+	for (i = 0; i < ns->nr_parts; i++)
+		memset(conv_ftls[i].gc_stats, 0, sizeof(conv_ftls[i].gc_stats));
+}
+
+/*
+ * FTL snapshot layout:
+ *   conv_snapshot_hdr
+ *   per partition:
+ *     conv_snapshot_part
+ *     line ipc/vpc, then the ids on the free, full and victim lists
+ *     maptbl, rmap
+ *     per-block state (ssd_snapshot_save())
+ * The header is marked complete only after everything else is written.
+ */
+#define CONV_SNAPSHOT_MAGIC (0x50414e5356454d56ULL) /* "VMEVSNAP" */
+#define CONV_SNAPSHOT_VERSION (6)
+
+struct conv_snapshot_hdr {
+	uint64_t magic;
+	uint32_t version;
+	uint32_t nr_parts;
+	uint64_t ns_size;
+	uint64_t tt_pgs;
+	uint64_t tt_blks;
+	uint64_t tt_lines;
+	uint32_t pgs_per_blk;
+	uint32_t maptbl_ent_size;
+	uint32_t gc_streams;
+	uint32_t slc_lines; /* taken out of the line lists */
+	uint64_t total_size;
+	uint32_t complete;
+};
+
+struct conv_snapshot_wp {
+	int32_t line; /* -1 if not allocated yet */
+	uint32_t ch;
+	uint32_t lun;
+	uint32_t pg;
+	uint32_t blk;
+	uint32_t pl;
+};
+
+struct conv_snapshot_part {
+	struct conv_snapshot_wp wps[NR_MAX_RUH];
+	struct conv_snapshot_wp gc_wps[NR_MAX_RUH];
+	uint32_t write_credits;
+	uint32_t credits_to_refill;
+	uint32_t active_ruh_count;
+	uint32_t active_gc_streams;
+	uint32_t free_line_cnt;
+	uint32_t full_line_cnt;
+	uint32_t victim_line_cnt;
+	uint32_t close_seq;
+};
+
+static size_t __snapshot_part_size(struct conv_ftl *conv_ftl)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+
+	return sizeof(struct conv_snapshot_part) + spp->tt_lines * sizeof(int32_t) * (6 + NR_MAX_RUH) +
+		   spp->tt_pgs * (sizeof(maptbl_ent_t) + sizeof(rmap_ent_t)) + ssd_snapshot_size(conv_ftl->ssd);
+}
+
+size_t conv_snapshot_size(struct nvmev_ns *ns)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+
+	return sizeof(struct conv_snapshot_hdr) + __snapshot_part_size(&conv_ftls[0]) * ns->nr_parts;
+}
+
+static void __save_wp(struct conv_snapshot_wp *dst, struct write_pointer *wp)
+{
+	*dst = (struct conv_snapshot_wp){
+		.line = wp->curline ? wp->curline->id : -1,
+		.ch = wp->ch,
+		.lun = wp->lun,
+		.pg = wp->pg,
+		.blk = wp->blk,
+		.pl = wp->pl,
+	};
+}
+
+static void __load_wp(struct conv_ftl *conv_ftl, struct write_pointer *wp, struct conv_snapshot_wp *src)
+{
+	*wp = (struct write_pointer){
+		.curline = (src->line < 0) ? NULL : &conv_ftl->lm.lines[src->line],
+		.ch = src->ch,
+		.lun = src->lun,
+		.pg = src->pg,
+		.blk = src->blk,
+		.pl = src->pl,
+	};
+}
+
+static void *__snapshot_save_part(struct conv_ftl *conv_ftl, void *dst)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct conv_snapshot_part *part = dst;
+	int32_t *ids;
+	struct line *line;
+	size_t i;
+
+	for (i = 0; i < NR_MAX_RUH; i++) {
+		__save_wp(&part->wps[i], &conv_ftl->wps[i]);
+		__save_wp(&part->gc_wps[i], &conv_ftl->gc_wps[i]);
+	}
+	part->write_credits = conv_ftl->wfc.write_credits;
+	part->credits_to_refill = conv_ftl->wfc.credits_to_refill;
+	part->active_ruh_count = conv_ftl->active_ruh_count;
+	part->active_gc_streams = conv_ftl->active_gc_streams;
+	part->free_line_cnt = lm->free_line_cnt;
+	part->full_line_cnt = lm->full_line_cnt;
+	part->victim_line_cnt = lm->victim_line_cnt;
+	part->close_seq = lm->close_seq;
+
+	/* per-line counters */
+	ids = (int32_t *)(part + 1);
+	for (i = 0; i < lm->tt_lines; i++) {
+		*ids++ = lm->lines[i].ipc;
+		*ids++ = lm->lines[i].vpc;
+		*ids++ = lm->lines[i].close_seq;
+		*ids++ = lm->lines[i].ruh_mask;
+		*ids++ = lm->lines[i].gc_gen;
+		memcpy(ids, lm->lines[i].ruh_pgs, sizeof(int32_t) * NR_MAX_RUH);
+		ids += NR_MAX_RUH;
+	}
+
+	/* list membership, in list order */
+	list_for_each_entry(line, &lm->free_line_list, entry)
+		*ids++ = line->id;
+	list_for_each_entry(line, &lm->full_line_list, entry)
+		*ids++ = line->id;
+	for_each_victim_line(lm, i, line)
+		*ids++ = line->id;
+
+	dst = ids;
+	memcpy(dst, conv_ftl->maptbl, sizeof(maptbl_ent_t) * spp->tt_pgs);
+	dst += sizeof(maptbl_ent_t) * spp->tt_pgs;
+	memcpy(dst, conv_ftl->rmap, sizeof(rmap_ent_t) * spp->tt_pgs);
+	dst += sizeof(rmap_ent_t) * spp->tt_pgs;
+
+	return ssd_snapshot_save(conv_ftl->ssd, dst);
+}
+
+static void *__snapshot_load_part(struct conv_ftl *conv_ftl, void *src)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct line_mgmt *lm = &conv_ftl->lm;
+	struct conv_snapshot_part *part = src;
+	int32_t *ids;
+	size_t i;
+
+	/* start from empty lists, the snapshot says where every line goes */
+	INIT_LIST_HEAD(&lm->free_line_list);
+	INIT_LIST_HEAD(&lm->full_line_list);
+	victim_reset(lm);
+
+	ids = (int32_t *)(part + 1);
+	for (i = 0; i < lm->tt_lines; i++) {
+		struct line *line = &lm->lines[i];
+
+		line->ipc = *ids++;
+		line->vpc = *ids++;
+		line->close_seq = *ids++;
+		line->ruh_mask = *ids++;
+		line->gc_gen = *ids++;
+		memcpy(line->ruh_pgs, ids, sizeof(int32_t) * NR_MAX_RUH);
+		ids += NR_MAX_RUH;
+		line->victim = false;
+		INIT_LIST_HEAD(&line->entry);
+	}
+
+	for (i = 0; i < part->free_line_cnt; i++)
+		list_add_tail(&lm->lines[*ids++].entry, &lm->free_line_list);
+	for (i = 0; i < part->full_line_cnt; i++)
+		list_add_tail(&lm->lines[*ids++].entry, &lm->full_line_list);
+	for (i = 0; i < part->victim_line_cnt; i++)
+		victim_insert(lm, &lm->lines[*ids++]);
+
+	lm->free_line_cnt = part->free_line_cnt;
+	lm->full_line_cnt = part->full_line_cnt;
+	lm->close_seq = part->close_seq;
+
+	for (i = 0; i < NR_MAX_RUH; i++) {
+		__load_wp(conv_ftl, &conv_ftl->wps[i], &part->wps[i]);
+		__load_wp(conv_ftl, &conv_ftl->gc_wps[i], &part->gc_wps[i]);
+	}
+	conv_ftl->wfc.write_credits = part->write_credits;
+	conv_ftl->wfc.credits_to_refill = part->credits_to_refill;
+	conv_ftl->active_ruh_count = part->active_ruh_count;
+	conv_ftl->active_gc_streams = part->active_gc_streams;
+
+	src = ids;
+	memcpy(conv_ftl->maptbl, src, sizeof(maptbl_ent_t) * spp->tt_pgs);
+	src += sizeof(maptbl_ent_t) * spp->tt_pgs;
+	memcpy(conv_ftl->rmap, src, sizeof(rmap_ent_t) * spp->tt_pgs);
+	src += sizeof(rmap_ent_t) * spp->tt_pgs;
+
+	return ssd_snapshot_load(conv_ftl->ssd, src);
+}
+
+/*
+ * Allocate the page state the partition at src needs: the materialized
+ * blocks and the lines open for writes. Returns the end of the partition,
+ * or NULL if out of memory.
+ */
+static void *__snapshot_reserve_part(struct conv_ftl *conv_ftl, void *src)
+{
+	struct ssdparams *spp = &conv_ftl->ssd->sp;
+	struct conv_snapshot_part *part = src;
+	size_t i;
+
+	for (i = 0; i < NR_MAX_RUH; i++) {
+		if (part->wps[i].line >= 0 && materialize_line(conv_ftl, &conv_ftl->lm.lines[part->wps[i].line]))
+			return NULL;
+		if (part->gc_wps[i].line >= 0 &&
+			materialize_line(conv_ftl, &conv_ftl->lm.lines[part->gc_wps[i].line]))
+			return NULL;
+	}
+
+	src = (int32_t *)(part + 1) + conv_ftl->lm.tt_lines * (5 + NR_MAX_RUH) + part->free_line_cnt +
+		  part->full_line_cnt + part->victim_line_cnt;
+	src += spp->tt_pgs * (sizeof(maptbl_ent_t) + sizeof(rmap_ent_t));
+
+	return ssd_snapshot_reserve(conv_ftl->ssd, src);
+}
+
+static void __snapshot_fill_hdr(struct nvmev_ns *ns, struct conv_snapshot_hdr *hdr)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	struct ssdparams *spp = &conv_ftls[0].ssd->sp;
+
+	*hdr = (struct conv_snapshot_hdr){
+		.magic = CONV_SNAPSHOT_MAGIC,
+		.version = CONV_SNAPSHOT_VERSION,
+		.nr_parts = ns->nr_parts,
+		.ns_size = ns->size,
+		.tt_pgs = spp->tt_pgs,
+		.tt_blks = spp->tt_blks,
+		.tt_lines = spp->tt_lines,
+		.pgs_per_blk = spp->pgs_per_blk,
+		.maptbl_ent_size = sizeof(maptbl_ent_t),
+		.gc_streams = conv_ftls[0].cp.gc_streams,
+		.slc_lines = conv_ftls[0].slc.nr_lines,
+		.complete = 0,
+	};
+}
+
+/* Serialize the FTL state of ns into dst. The device must be idle. */
+int conv_snapshot_save(struct nvmev_ns *ns, void *dst, size_t size)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	struct conv_snapshot_hdr *hdr = dst;
+	void *pos = hdr + 1;
+	uint32_t i;
+
+	if (size < conv_snapshot_size(ns)) {
+		NVMEV_ERROR("snapshot: needs %zu MiB, only %zu MiB reserved\n", BYTE_TO_MB(conv_snapshot_size(ns)),
+					BYTE_TO_MB(size));
+		return -ENOSPC;
+	}
+
+	__snapshot_fill_hdr(ns, hdr);
+	conv_pause_bg_gc(ns, true);
+	for (i = 0; i < ns->nr_parts; i++) {
+		/* the snapshot has no room for a half-collected victim */
+		gc_cur_finish(&conv_ftls[i]);
+		pos = __snapshot_save_part(&conv_ftls[i], pos);
+	}
+	conv_pause_bg_gc(ns, false);
+
+	hdr->total_size = pos - dst;
+	wmb();
+	hdr->complete = 1;
+
+	NVMEV_INFO("snapshot: saved %llu MiB of FTL state\n", BYTE_TO_MB(hdr->total_size));
+	return 0;
+}
+
+/* Restore the FTL state of ns from src if it holds a matching snapshot */
+int conv_snapshot_load(struct nvmev_ns *ns, void *src, size_t size)
+{
+	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
+	struct conv_snapshot_hdr *hdr = src, expected;
+	void *pos = hdr + 1;
+	uint32_t i;
+
+	__snapshot_fill_hdr(ns, &expected);
+	if (hdr->magic != expected.magic || !hdr->complete) {
+		NVMEV_INFO("snapshot: none found, starting from a clean FTL\n");
+		return -ENOENT;
+	}
+
+	if (hdr->version != expected.version || hdr->nr_parts != expected.nr_parts ||
+		hdr->ns_size != expected.ns_size || hdr->tt_pgs != expected.tt_pgs || hdr->tt_blks != expected.tt_blks ||
+		hdr->tt_lines != expected.tt_lines || hdr->pgs_per_blk != expected.pgs_per_blk ||
+		hdr->maptbl_ent_size != expected.maptbl_ent_size || hdr->gc_streams != expected.gc_streams ||
+		hdr->slc_lines != expected.slc_lines || hdr->total_size > size) {
+		NVMEV_ERROR("snapshot: geometry does not match this configuration, ignored\n");
+		return -EINVAL;
+	}
+
+	/* allocate first, running out of memory then leaves a clean FTL */
+	for (i = 0; i < ns->nr_parts && pos; i++)
+		pos = __snapshot_reserve_part(&conv_ftls[i], pos);
+	if (!pos) {
+		NVMEV_ERROR("snapshot: out of memory for the page state, ignored\n");
+		return -ENOMEM;
+	}
+
+	pos = hdr + 1;
+	conv_pause_bg_gc(ns, true);
+	for (i = 0; i < ns->nr_parts; i++)
+		pos = __snapshot_load_part(&conv_ftls[i], pos);
+	conv_pause_bg_gc(ns, false);
+
+	NVMEV_ASSERT(pos - src == hdr->total_size);
+	/* consumed: only a new save makes it valid again, not a crash after this load */
+	hdr->complete = 0;
+	wmb();
+	NVMEV_INFO("snapshot: restored %llu MiB of FTL state\n", BYTE_TO_MB(hdr->total_size));
+	return 0;
+}
+
 void conv_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret)
 {
 	uint64_t start, latest;
 	uint32_t i;
 	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
 
-	start = local_clock();
+	start = nvmev_clock();
 	latest = start;
 	for (i = 0; i < ns->nr_parts; i++) {
 		latest = max(latest, ssd_next_idle_time(conv_ftls[i].ssd));
@@ -1334,7 +3288,6 @@ void conv_dsm(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_resul
 {
 	// Currently only the Trim command is supported
 	struct conv_ftl *conv_ftls = (struct conv_ftl *)ns->ftls;
-	struct conv_ftl *conv_ftl = &conv_ftls[0];
 	struct nvme_command *cmd = req->cmd;
 	uint32_t num_range = cmd->dsm.nr + 1; 
 	uint32_t attr = cmd->dsm.attributes;
@@ -1353,30 +3306,21 @@ void conv_dsm(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_resul
 		struct nvme_dsm_range *r = (ranges + i);
 		uint64_t slba = r->slba;
 		uint32_t nlb = r->nlb; // 1's based value
-		uint32_t nr_parts = ns->nr_parts;
 		struct ssdparams *spp = &conv_ftls[0].ssd->sp;
 		uint64_t start_lpn = slba / spp->secs_per_pg;
 		uint64_t end_lpn = (slba + nlb - 1) / spp->secs_per_pg;
-		uint64_t lpn, local_lpn;
-		struct ppa ppa;
+		struct conv_part_cmd pcmds[SSD_PARTITIONS];
 
 		NVMEV_INFO("DSM TRIM: slba=%llu, nlb=%u, start_lpn=%llu, end_lpn=%llu\n",
 			slba, nlb, start_lpn, end_lpn);
 
-		for (lpn = start_lpn; lpn <= end_lpn; lpn++) {
-			conv_ftl = &conv_ftls[lpn % nr_parts];
-			local_lpn = lpn / nr_parts;
-			ppa = get_maptbl_ent(conv_ftl, local_lpn);
-			if (!mapped_ppa(&ppa) || !valid_ppa(conv_ftl, &ppa)) {
-				continue;
-			} else {
-				/* update old page information first */
-				mark_page_invalid(conv_ftl, &ppa);
-				set_rmap_ent(conv_ftl, INVALID_LPN, &ppa);
-				ppa.ppa = UNMAPPED_PPA;
-				set_maptbl_ent(conv_ftl, local_lpn, &ppa);
-			}
-		}
+		if (conv_ftls[0].cp.ra_pgs > 0)
+			conv_ra_invalidate(&conv_ftls[0].ra, start_lpn, end_lpn);
+
+		pcmds[0].opcode = nvme_cmd_dsm;
+		pcmds[0].sq_id = req->sq_id;
+		pcmds[0].ncmd.stime = req->nsecs_start;
+		__conv_run_parts(ns, pcmds, start_lpn, end_lpn);
 	}
 	kfree(ranges);
 }
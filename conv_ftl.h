@@ -16,7 +16,8 @@
 #define _NVMEVIRT_CONV_FTL_H
 
 #include <linux/types.h>
-#include "pqueue.h"
+#include <linux/atomic.h>
+#include <linux/mutex.h>
 #include "ssd_config.h"
 #include "ssd.h"
 
@@ -24,6 +25,16 @@ struct convparams {
 	uint32_t gc_thres_lines;
 	uint32_t gc_thres_lines_high;
 	bool enable_gc_delay;
+	uint32_t bg_gc_lines; /* background GC keeps this many lines above the foreground threshold */
+	uint64_t bg_gc_idle_ns; /* no host I/O for this long counts as idle */
+	bool gc_incremental; /* spread victim copies over host writes */
+	uint32_t gc_copy_ratio; /* incremental GC: pages copied per 100 host pages, 0: vpc/ipc of the victim */
+	int gc_streams; /* GC_STREAM_* */
+	uint32_t nr_gc_streams; /* GC write pointers the mode may open */
+	uint32_t ra_pgs; /* read-ahead window in pages, 0: disabled */
+	uint32_t map_seg_lpns; /* mapping entries per cached segment */
+	uint32_t map_cache_segs; /* segments cached in DRAM, 0: the whole table */
+	uint32_t slc_lines; /* lines set aside as SLC write cache, 0: none */
 
 	double op_area_pcent;
 	int pba_pcent; /* (physical space / logical space) * 100*/
@@ -34,9 +45,12 @@ typedef struct line {
 	int ipc; /* invalid page count in this line */
 	int vpc; /* valid page count in this line */
 	//QTAILQ_ENTRY(line) _entry; /* in either {free,victim,full} list */
-	struct list_head entry;
-	/* position in the priority queue for victim lines */
-	size_t pos;
+	struct list_head entry; /* in a victim bucket while victim is set */
+	bool victim; /* in the victim index */
+	uint32_t close_seq; /* lm->close_seq when the line was closed, for age */
+	uint32_t ruh_mask; /* placement handles with data in this line */
+	uint32_t gc_gen; /* 0: written by the host, else 1 + the GC stream that wrote it */
+	uint32_t ruh_pgs[NR_MAX_RUH]; /* pages programmed per RUH */
 } line;
 
 /* wp: record next write addr */
@@ -55,7 +69,11 @@ struct line_mgmt {
 	/* free line list, we only need to maintain a list of blk numbers */
 	//QTAILQ_HEAD(free_line_list, line) _free_line_list;
 	struct list_head free_line_list;
-	pqueue_t *victim_line_pq;
+	/* victim lines bucketed by vpc, FIFO within a bucket */
+	struct list_head *victim_buckets;
+	unsigned long *victim_nonempty; /* bit per non-empty bucket */
+	uint32_t nr_victim_buckets;
+	uint32_t victim_min_vpc; /* no victim line has fewer valid pages */
 	// //QTAILQ_HEAD(victim_line_list, line) victim_line_list;
 	struct list_head full_line_list;
 	//QTAILQ_HEAD(full_line_list, line) _full_line_list;
@@ -64,24 +82,214 @@ struct line_mgmt {
 	uint32_t free_line_cnt;
 	uint32_t victim_line_cnt;
 	uint32_t full_line_cnt;
+	uint32_t close_seq; /* number of lines closed so far */
 };
 
+/* GC victim selection, chosen by the gc_policy parameter or /proc/nvmev/gc_policy */
+enum {
+	GC_POLICY_GREEDY = 0, /* fewest valid pages */
+	GC_POLICY_COST_BENEFIT = 1, /* max age * (1 - u) / 2u */
+	GC_POLICY_WINDOWED = 2, /* greedy among the GC_WINDOW_LINES oldest lines */
+	GC_POLICY_RUH_AWARE = 3, /* greedy, preferring lines that hold a single RUH */
+	NR_GC_POLICIES,
+};
+
+#define GC_WINDOW_LINES (16)
+
+/* Where GC relocates valid pages, chosen by the gc_streams parameter */
+enum {
+	GC_STREAM_SINGLE = 0, /* one GC write pointer for everything */
+	GC_STREAM_RUH = 1, /* one per RUH, pages keep their placement */
+	GC_STREAM_AGE = 2, /* by the number of times the data survived GC */
+	NR_GC_STREAM_MODES,
+};
+
+#define GC_AGE_CLASSES (4)
+
+/* A victim line being collected one flash-page row at a time */
+struct conv_gc_cursor {
+	struct line *victim; /* NULL when no GC is in progress */
+	uint32_t flashpg; /* next row */
+	uint32_t copy_ratio; /* pages to copy per 100 host pages */
+	uint32_t valid_ruh[NR_MAX_LEVEL];
+	uint32_t invalid_ruh[NR_MAX_LEVEL];
+};
+
+/* pages programmed while a policy was active, for per-policy WAF */
+struct conv_gc_stat {
+	uint64_t host_pgs;
+	uint64_t gc_pgs;
+};
+
+/*
+ * With COMPACT_MAPTBL, maptbl and rmap hold 32-bit linear page indices
+ * (see ppa2pgidx()) instead of full ppa/lpn values; INVALID32 marks an
+ * unmapped entry.
+ */
+#if (COMPACT_MAPTBL == 1)
+typedef uint32_t maptbl_ent_t;
+typedef uint32_t rmap_ent_t;
+#else
+typedef struct ppa maptbl_ent_t;
+typedef uint64_t rmap_ent_t;
+#endif
+
 struct write_flow_control {
 	uint32_t write_credits;
 	uint32_t credits_to_refill;
 };
 
+/* Slice of a host command that falls on a single partition */
+struct conv_part_cmd {
+	int opcode; /* nvme_cmd_read, nvme_cmd_write or nvme_cmd_dsm */
+	uint32_t sq_id;
+	uint64_t start_lpn; /* first LPN of the command on this partition */
+	uint64_t end_lpn;
+	uint32_t nr_parts; /* LPN stride */
+	uint16_t ruh;
+	uint16_t ruh_tag;
+	struct nand_cmd ncmd; /* timing template, nand_stime is updated */
+	uint64_t nsecs_hit; /* read: completion of pages found in the write buffer */
+	uint64_t nsecs_latest; /* completion time of the slice */
+	uint32_t nr_failed; /* write: pages of the slice left unwritten as no line could be opened */
+	atomic_t *pending;
+};
+
+#define CONV_RA_STREAMS (4)
+#define CONV_RA_TRIGGER (2) /* sequential reads in a row before read-ahead starts */
+
+/* A sequential read stream and the LPNs read ahead for it */
+struct conv_ra_stream {
+	uint64_t id; /* changes when the slot is taken over by another stream */
+	uint64_t next_lpn; /* the stream continues with a read starting here */
+	uint32_t seq_cnt;
+	bool fetching; /* LPNs [fetch_start, fetch_end) are being read as the next window */
+	bool fetch_stale; /* a write hit them meanwhile, the window is dropped when read */
+	uint64_t fetch_start;
+	uint64_t fetch_end;
+	uint64_t ra_start; /* LPNs [ra_start, ra_end) are, or will be, in DRAM */
+	uint64_t ra_end;
+	uint64_t ra_ready; /* when the read-ahead data is in DRAM */
+	uint64_t last_used;
+};
+
+/* Namespace-wide read-ahead state, kept in the first partition */
+struct conv_read_ahead {
+	struct mutex lock;
+	uint64_t seq; /* stream ids and LRU order */
+	struct conv_ra_stream streams[CONV_RA_STREAMS];
+};
+
+#define CONV_MAP_ENTRY_SIZE (4) /* bytes per mapping entry on flash */
+
+/* per-segment state of the cached mapping table */
+enum {
+	MAP_SEG_CACHED = 1 << 0,
+	MAP_SEG_REF = 1 << 1, /* CLOCK reference bit */
+	MAP_SEG_DIRTY = 1 << 2,
+};
+
+/* Mapping table segments held in DRAM when map_cache_kb is set (timing only) */
+struct conv_map_cache {
+	uint32_t nr_segs;
+	uint32_t nr_slots; /* 0: the whole table is in DRAM */
+	uint32_t nr_cached;
+	uint32_t hand; /* CLOCK hand over the slots */
+	uint32_t seg_bytes;
+	uint32_t *slot_seg; /* segment held by each slot */
+	uint8_t *seg_state; /* MAP_SEG_* per segment */
+	uint32_t wb_bytes; /* evicted dirty segments not programmed yet */
+	uint32_t wb_die; /* dies take the map programs in turn */
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t dirty_evicts;
+};
+
+struct conv_map_stat {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t dirty_evicts;
+};
+
+/* A host wordline written to the SLC cache, to be folded into its TLC location */
+struct conv_slc_wl {
+	struct ppa ppa; /* last page of the wordline */
+	int erase_cnt; /* of its block, a mismatch means the data is gone */
+};
+
+/* SLC write cache made of slc_lines dedicated lines */
+struct conv_slc_cache {
+	uint32_t nr_lines;
+	uint32_t capacity; /* wordlines the lines hold in SLC mode, 0: no cache */
+	uint32_t head; /* fold queue, oldest first */
+	uint32_t nr_cached;
+	struct conv_slc_wl *fold_q;
+	uint64_t written; /* wordlines programmed in SLC mode */
+	uint64_t folded;
+	uint64_t dropped; /* no valid data left when their turn to fold came */
+	uint64_t forced; /* folds made to let a write in */
+};
+
+struct conv_slc_stat {
+	uint32_t nr_cached;
+	uint32_t capacity;
+	uint64_t written;
+	uint64_t folded;
+	uint64_t dropped;
+	uint64_t forced;
+};
+
+#define CONV_SHARD_RING_SIZE (256)
+
+/* Owner thread of one partition, fed by the dispatchers through a ring */
+struct conv_shard {
+	struct conv_ftl *conv_ftl;
+	struct task_struct *thread;
+	char thread_name[32];
+
+	atomic_t tail; /* next slot to be claimed by a producer */
+	unsigned int head; /* next slot to be consumed, owner only */
+	struct conv_part_cmd *ring[CONV_SHARD_RING_SIZE];
+};
+
 struct conv_ftl {
 	struct ssd *ssd;
+	struct conv_shard *shard; /* NULL when commands run on the dispatcher */
+	struct mutex lock; /* slices vs. background GC and preconditioning */
+	struct task_struct *bg_gc_thread;
+	uint64_t last_host_io; /* nvmev_clock() of the last host read/write */
+	uint64_t bg_gc_next; /* earliest next background GC while the host is busy */
+	bool bg_gc_paused; /* set while metadata is rewritten outside the I/O path */
+	struct conv_gc_cursor gc_cur; /* incremental/background GC in progress */
+	bool gc_cur_busy;
+	int64_t gc_debt; /* copies owed by host writes, in 1/100 pages */
 
 	struct convparams cp;
-	struct ppa *maptbl; /* page level mapping table */
-	uint64_t *rmap; /* reverse mapptbl, assume it's stored in OOB */
+	maptbl_ent_t *maptbl; /* page level mapping table */
+	rmap_ent_t *rmap; /* reverse mapptbl, assume it's stored in OOB */
 	struct write_pointer wps[NR_MAX_RUH];
-	struct write_pointer gc_wp;
+	struct write_pointer gc_wps[NR_MAX_RUH]; /* indexed by GC stream */
 	struct line_mgmt lm;
 	struct write_flow_control wfc;
 	uint32_t active_ruh_count; /* Number of RUHs with allocated lines */
+	uint32_t active_gc_streams; /* Number of GC streams with allocated lines */
+	struct conv_gc_stat gc_stats[NR_GC_POLICIES];
+	struct conv_read_ahead ra;
+	struct conv_map_cache mc;
+	struct conv_slc_cache slc;
+};
+
+/* Instant preconditioning, driven by /proc/nvmev/precondition */
+enum {
+	PRECOND_SEQ = 0, /* sequential fill only */
+	PRECOND_RAND = 1, /* sequential fill followed by uniform random overwrites */
+};
+
+struct conv_precond_spec {
+	int mode;
+	uint32_t fill_pcent; /* part of the logical space to fill, in % */
+	uint32_t nr_ruh; /* filled space is split evenly, range i is written through RUH i */
+	uint32_t overwrite_pcent[NR_MAX_RUH]; /* PRECOND_RAND: overwrites of range i, in % of its size */
 };
 
 void conv_init_namespace(struct nvmev_ns *ns, uint32_t id, uint64_t size, void *mapped_addr,
@@ -92,6 +300,16 @@ bool conv_proc_nvme_io_cmd(struct nvmev_ns *ns, struct nvmev_request *req, struc
 bool conv_read(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
 bool conv_write(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
 void conv_flush(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
+int conv_precondition(struct nvmev_ns *ns, struct conv_precond_spec *spec);
+
+void conv_gc_stats(struct nvmev_ns *ns, int policy, struct conv_gc_stat *stat);
+void conv_gc_stats_reset(struct nvmev_ns *ns);
+void conv_map_stats(struct nvmev_ns *ns, struct conv_map_stat *stat);
+void conv_slc_stats(struct nvmev_ns *ns, struct conv_slc_stat *stat);
+
+size_t conv_snapshot_size(struct nvmev_ns *ns);
+int conv_snapshot_save(struct nvmev_ns *ns, void *dst, size_t size);
+int conv_snapshot_load(struct nvmev_ns *ns, void *src, size_t size);
 
 bool pcie_rw(struct nvmev_ns *ns, struct nvmev_request *req, struct nvmev_result *ret);
 #endif
@@ -61,7 +61,7 @@ static struct ccsd_freebie_parameter freebie_param;
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(vdev->config.cpu_nr_dispatcher[0]);
+	return nvmev_clock();
 }
 
 static void __copy_prp_data(int sqid, int sq_entry, void *buf, size_t size, bool from_host)
@@ -1264,10 +1264,7 @@ static void __reclaim_io_req(void)
 	unsigned int total_count = 0;
 	struct csd_internal_io_req *io_req;
 
-	unsigned long long curr_nsecs_wall = __get_wallclock();
-	unsigned long long curr_nsecs_local = local_clock();
-	long long delta = curr_nsecs_wall - curr_nsecs_local;
-	unsigned long long curr_nsecs = local_clock() + delta;
+	unsigned long long curr_nsecs = __get_wallclock();
 
 	// SLM Queue
 	for (turn = 0; turn < task_table.num_slm_resources; turn++) {
@@ -1725,10 +1722,7 @@ static int nvmev_kthread_ccsd_io(void *data)
 	NVMEV_INFO("%s started on cpu %d (node %d)", pi->thread_name, smp_processor_id(), cpu_to_node(smp_processor_id()));
 
 	while (!kthread_should_stop()) {
-		unsigned long long curr_nsecs_wall = __get_wallclock();
-		unsigned long long curr_nsecs_local = local_clock();
-		long long delta = curr_nsecs_wall - curr_nsecs_local;
-
+		unsigned long long curr_nsecs_wall;
 		unsigned long long curr_nsecs;
 		volatile unsigned int curr;
 		struct nvmev_proc_table *pe;
@@ -1739,7 +1733,7 @@ static int nvmev_kthread_ccsd_io(void *data)
 			curr = pi->io_seq;
 			if (curr != -1) {
 				pe = &pi->proc_table[curr];
-				curr_nsecs = local_clock() + delta;
+				curr_nsecs = __get_wallclock();
 				pi->proc_io_nsecs = curr_nsecs;
 
 				if (pe->next == -1) {
@@ -2054,13 +2048,9 @@ static int slm_work(void *data)
 	struct ccsd_list *slm_list = (struct ccsd_list *)data;
 	int pid = smp_processor_id();
 	int nsid = 0; // TODO
-	unsigned long long curr_nsecs_wall = __get_wallclock();
-	unsigned long long curr_nsecs_local = local_clock();
-	long long delta = curr_nsecs_wall - curr_nsecs_local;
-
 	NVMEV_INFO("slm_work started on cpu %d (node %d)", pid, cpu_to_node(smp_processor_id()));
 	while (!kthread_should_stop()) {
-		unsigned long long curr_nsecs = local_clock() + delta;
+		unsigned long long curr_nsecs = __get_wallclock();
 		unsigned long long min_target_time = -1;
 		int io_req_id = slm_list->head;
 		struct csd_internal_io_req *io_req;
@@ -42,7 +42,7 @@ size_t lastest_token = -1;
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(vdev->config.cpu_nr_dispatcher[0]);
+	return nvmev_clock();
 }
 
 // #define ALIGN(x, a)   (((x) + ((a) - 1)) & ~((a) - 1))
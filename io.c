@@ -24,12 +24,6 @@
 
 #include "user_function/freebie/freebie_functions.h"
 
-#if ((BASE_SSD == SAMSUNG_970PRO) || (BASE_SSD) == ZNS_PROTOTYPE || (BASE_SSD) == SAMSUNG_PM9D3A)
-#include "ssd.h"
-#else
-struct buffer;
-#endif
-
 #if (CSD_ENABLE == 1)
 #include "nvme_csd.h"
 #include "csd_slm.h"
@@ -50,7 +44,47 @@ extern bool io_using_dma;
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(vdev->config.cpu_nr_dispatcher[0]);
+	return nvmev_clock();
+}
+
+/*
+ * Move one chunk of payload between a host buffer and the storage backing
+ * of namespace nsid according to data_mode.
+ */
+static void __copy_ns_data(size_t nsid, size_t offset, void *buf, size_t size, bool is_write)
+{
+	size_t backing_size = vdev->config.storage_size;
+	void *mapped = vdev->ns[nsid].mapped;
+
+	switch (vdev->config.data_mode) {
+	case DATA_MODE_NONE:
+		if (!is_write)
+			memset(buf, 0, size);
+		break;
+
+	case DATA_MODE_FOLD:
+		while (size) {
+			size_t offs = offset % backing_size;
+			size_t len = min_t(size_t, size, backing_size - offs);
+
+			if (is_write)
+				memcpy(mapped + offs, buf, len);
+			else
+				memcpy(buf, mapped + offs, len);
+
+			offset += len;
+			buf += len;
+			size -= len;
+		}
+		break;
+
+	default:
+		if (is_write)
+			memcpy(mapped + offset, buf, size);
+		else
+			memcpy(buf, mapped + offset, size);
+		break;
+	}
 }
 
 static unsigned int __do_perform_io(int sqid, int sq_entry, unsigned int *result)
@@ -162,9 +196,9 @@ static unsigned int __do_perform_io(int sqid, int sq_entry, unsigned int *result
 		}
 
 		if (opcode == nvme_cmd_write) {
-			memcpy(vdev->ns[nsid].mapped + offset, vaddr + mem_offs, io_size);
+			__copy_ns_data(nsid, offset, vaddr + mem_offs, io_size, true);
 		} else if (opcode == nvme_cmd_read) {
-			memcpy(vaddr + mem_offs, vdev->ns[nsid].mapped + offset, io_size);
+			__copy_ns_data(nsid, offset, vaddr + mem_offs, io_size, false);
 		}
 #if (CSD_ENABLE == 1)
 		else if (opcode == nvme_cmd_freebie_get_partition_map) {
@@ -412,7 +446,6 @@ static void __insert_req_into_csd(int sqid, int cqid, int sq_entry, unsigned lon
 	pi->proc_table[entry].prev = -1;
 	pi->proc_table[entry].next = -1;
 
-	pi->proc_table[entry].writeback_cmd = false;
 	pi->proc_table[entry].gc_cmd = false;
 	mb(); /* IO kthread shall see the updated pe at once */
 
@@ -467,7 +500,7 @@ static void __enqueue_io_req(int sqid, int cqid, int sq_entry, unsigned long lon
 	pi->proc_table[entry].sq_entry = sq_entry;
 	pi->proc_table[entry].command_id = sq_entry(sq_entry).common.command_id;
 	pi->proc_table[entry].nsecs_start = nsecs_start;
-	pi->proc_table[entry].nsecs_enqueue = local_clock();
+	pi->proc_table[entry].nsecs_enqueue = __get_wallclock();
 	pi->proc_table[entry].nsecs_nand_start = ret->nsecs_nand_start;
 	pi->proc_table[entry].nsecs_target = ret->nsecs_target;
 	pi->proc_table[entry].status = ret->status;
@@ -476,7 +509,6 @@ static void __enqueue_io_req(int sqid, int cqid, int sq_entry, unsigned long lon
 	pi->proc_table[entry].prev = -1;
 	pi->proc_table[entry].next = -1;
 
-	pi->proc_table[entry].writeback_cmd = false;
 	pi->proc_table[entry].gc_cmd = false;
 	mb(); /* IO kthread shall see the updated pe at once */
 
@@ -514,8 +546,8 @@ void enqueue_gc_io_req(int sqid, unsigned long long nsecs_target, bool is_write,
 
 	/////////////////////////////////
 	pi->proc_table[entry].sqid = sqid;
-	pi->proc_table[entry].nsecs_start = local_clock();
-	pi->proc_table[entry].nsecs_enqueue = local_clock();
+	pi->proc_table[entry].nsecs_start = __get_wallclock();
+	pi->proc_table[entry].nsecs_enqueue = __get_wallclock();
 	pi->proc_table[entry].nsecs_target = nsecs_target;
 	pi->proc_table[entry].is_completed = false;
 	pi->proc_table[entry].is_copied = true;
@@ -525,65 +557,11 @@ void enqueue_gc_io_req(int sqid, unsigned long long nsecs_target, bool is_write,
 	pi->proc_table[entry].gc_cmd = true;
 	pi->proc_table[entry].is_gc_write = is_write;
 	pi->proc_table[entry].gc_io_length = io_length;
-	pi->proc_table[entry].writeback_cmd = false;  /* Clear to prevent double release */
 	mb(); /* IO kthread shall see the updated pe at once */
 
 	__insert_req_into_io(entry, pi);
 }
 
-void enqueue_writeback_io_req(int sqid, unsigned long long nsecs_target, struct buffer *write_buffer,
-							  unsigned int buffs_to_release)
-{
-#if SUPPORT_MULTI_IO_WORKER_BY_SQ
-	unsigned int proc_turn = (sqid - 1) % (vdev->config.nr_io_cpu - 1);
-#else
-	unsigned int proc_turn = vdev->proc_turn;
-#endif
-	struct nvmev_proc_info *pi = &vdev->proc_info[proc_turn];
-	unsigned int entry;
-	
-	spin_lock(&pi->free_lock);
-	entry = pi->free_seq;
-
-	if (pi->proc_table[entry].next >= NR_MAX_PARALLEL_IO) {
-		WARN_ON_ONCE("IO queue is almost full");
-		pi->free_seq = entry;
-		spin_unlock(&pi->free_lock);
-		return;
-	}
-
-	if (++proc_turn == vdev->config.nr_io_cpu)
-		proc_turn = 0;
-	vdev->proc_turn = proc_turn;
-
-	pi->free_seq = pi->proc_table[entry].next;
-	spin_unlock(&pi->free_lock);
-	BUG_ON(pi->free_seq >= NR_MAX_PARALLEL_IO);
-
-	NVMEV_DEBUG("%s/%u[%d], sq %d cq %d, entry %d %llu + %llu\n", pi->thread_name, entry, sq_entry(sq_entry).rw.opcode,
-				sqid, cqid, sq_entry, nsecs_start, ret->nsecs_target - nsecs_start);
-
-	/////////////////////////////////
-	pi->proc_table[entry].sqid = sqid;
-	pi->proc_table[entry].nsecs_start = local_clock();
-	pi->proc_table[entry].nsecs_enqueue = local_clock();
-	pi->proc_table[entry].nsecs_target = nsecs_target;
-	pi->proc_table[entry].is_completed = false;
-	pi->proc_table[entry].is_copied = true;
-	pi->proc_table[entry].prev = -1;
-	pi->proc_table[entry].next = -1;
-
-	pi->proc_table[entry].writeback_cmd = true;
-	pi->proc_table[entry].buffs_to_release = buffs_to_release;
-	pi->proc_table[entry].write_buffer = (void *)write_buffer;
-
-	pi->proc_table[entry].gc_cmd = false;
-	mb(); /* IO kthread shall see the updated pe at once */
-
-	atomic64_add(buffs_to_release, &g_buffer_enqueue_bytes);
-	__insert_req_into_io(entry, pi);
-}
-
 static void __reclaim_completed_reqs(struct nvmev_proc_info *pi)
 {
 	struct nvmev_proc_table *pe;
@@ -712,7 +690,7 @@ static size_t __nvmev_proc_io(int sqid, int sq_entry)
 	__enqueue_io_req(sqid, sq->cqid, sq_entry, nsecs_start, &ret);
 
 #ifdef PERF_DEBUG
-	prev_clock3 = local_clock();
+	prev_clock3 = nvmev_clock();
 #endif
 	return true;
 }
@@ -830,9 +808,6 @@ static int nvmev_kthread_io(void *data)
 			   cpu_to_node(smp_processor_id()), pi->id);
 
 	while (!kthread_should_stop()) {
-		unsigned long long curr_nsecs_wall = __get_wallclock();
-		unsigned long long curr_nsecs_local = local_clock();
-		long long delta = curr_nsecs_wall - curr_nsecs_local;
 		unsigned long long curr_nsecs;
 
 		volatile unsigned int curr;
@@ -845,7 +820,7 @@ static int nvmev_kthread_io(void *data)
 			curr = pi->io_seq;
 			if (curr != -1) {
 				pe = &pi->proc_table[curr];
-				curr_nsecs = local_clock() + delta;
+				curr_nsecs = __get_wallclock();
 				pi->proc_io_nsecs = curr_nsecs;
 
 				if (pe->next == -1) {
@@ -868,9 +843,10 @@ static int nvmev_kthread_io(void *data)
 			if (pe->is_copied == false) {
 				struct nvmev_submission_queue *sq = vdev->sqes[pe->sqid];
 				struct nvme_command *nvme_cmd = (struct nvme_command *)(&sq_entry(pe->sq_entry));
-				if (pe->writeback_cmd || pe->gc_cmd) {
+				if (pe->gc_cmd) {
 					;
-				} else if (io_using_dma && (((nvme_cmd->rw.length + 1) << 12) >= 65536) 
+				} else if (io_using_dma && vdev->config.data_mode == DATA_MODE_FULL
+						&& (((nvme_cmd->rw.length + 1) << 12) >= 65536)
 						&& (nvme_cmd->common.opcode == nvme_cmd_write || nvme_cmd->common.opcode == nvme_cmd_read)) {
 					__do_perform_io_using_dma(pi->id, pe->sqid, pe->sq_entry);
 				} else {
@@ -888,17 +864,13 @@ static int nvmev_kthread_io(void *data)
 		curr = pi->cpl_seq;
 		while (curr != -1) {
 			struct nvmev_proc_table *pe = &pi->proc_table[curr];
-			curr_nsecs = local_clock() + delta;
+			curr_nsecs = __get_wallclock();
 			pi->proc_io_nsecs = curr_nsecs;
 
 			BUG_ON(pe->is_copied == false);
 
 			if (pe->is_completed == false && pe->nsecs_target <= curr_nsecs) {
-				if (pe->writeback_cmd) {
-#if ((BASE_SSD == SAMSUNG_970PRO) || (BASE_SSD) == ZNS_PROTOTYPE || (BASE_SSD) == SAMSUNG_PM9D3A)
-					buffer_release((struct buffer *)pe->write_buffer, pe->buffs_to_release);
-#endif
-				} else if (pe->gc_cmd) {
+				if (pe->gc_cmd) {
 					if (pe->is_gc_write) {
 						atomic64_add(pe->gc_io_length, &vdev->gc_write);
 					} else {
@@ -946,7 +918,7 @@ static int nvmev_kthread_io(void *data)
 				NVMEV_DEBUG("%s: completed %u, %d %d %d\n", pi->thread_name, curr, pe->sqid, pe->cqid, pe->sq_entry);
 
 #ifdef PERF_DEBUG
-				pe->nsecs_cq_filled = local_clock() + delta;
+				pe->nsecs_cq_filled = __get_wallclock();
 				trace_printk("%llu %llu %llu %llu %llu %llu\n", pe->nsecs_start, pe->nsecs_enqueue - pe->nsecs_start,
 							 pe->nsecs_copy_start - pe->nsecs_start, pe->nsecs_copy_done - pe->nsecs_start,
 							 pe->nsecs_cq_filled - pe->nsecs_start, pe->nsecs_target - pe->nsecs_start);
@@ -22,6 +22,7 @@
 #include <linux/delay.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
+#include <linux/log2.h>
 
 #include <asm/e820/types.h>
 #include <asm/e820/api.h>
@@ -88,10 +89,28 @@ unsigned int io_unit_shift = 12;
 
 char *dispatcher_cpus;
 char *worker_cpus;
+char *ftl_cpus;
 char *slm_cpus;
 char *csd_cpus;
 unsigned int debug = 0;
 
+unsigned int data_mode = DATA_MODE_FULL;
+unsigned long emul_size = 0;
+unsigned long snapshot_size = 0;
+unsigned int gc_policy = GC_POLICY_GREEDY;
+unsigned int bg_gc_lines = 0;
+unsigned int bg_gc_idle_us = 1000;
+unsigned int gc_incremental = 0;
+unsigned int gc_copy_ratio = 0;
+unsigned int gc_streams = GC_STREAM_SINGLE;
+unsigned int nand_sched = NAND_SCHED_FCFS;
+unsigned int nand_sched_weight = 4;
+unsigned int pcie_mps = PCIE_MAX_PAYLOAD;
+unsigned int read_ahead_kb = 0;
+unsigned int map_cache_kb = 0;
+unsigned int map_seg_kb = 4;
+unsigned int slc_lines = 0;
+
 int io_using_dma = true;
 
 module_param(memmap_start, ulong, 0444);
@@ -120,11 +139,45 @@ module_param(dispatcher_cpus, charp, 0444);
 MODULE_PARM_DESC(dispatcher_cpus, "CPU list for dispatcher threads, Seperated by Comma(,)");
 module_param(worker_cpus, charp, 0444);
 MODULE_PARM_DESC(worker_cpus, "CPU list for worker threads, Seperated by Comma(,)");
+module_param(ftl_cpus, charp, 0444);
+MODULE_PARM_DESC(ftl_cpus, "CPU list for FTL partition owner threads, Seperated by Comma(,) (default: run on dispatchers)");
 module_param(csd_cpus, charp, 0444);
 MODULE_PARM_DESC(csd_cpus, "CSD's CPU list for process, completion(int.) threads, Seperated by Comma(,)");
 module_param(slm_cpus, charp, 0444);
 MODULE_PARM_DESC(slm_cpus, "CSD's CPU list for SLM process, completion(int.) threads, Seperated by Comma(,)");
 module_param(debug, uint, 0644);
+module_param(data_mode, uint, 0444);
+MODULE_PARM_DESC(data_mode, "Payload backing: 0=full, 1=fold LBAs into memmap, 2=discard (reads return zeroes)");
+module_param(emul_size, ulong, 0444);
+MODULE_PARM_DESC(emul_size, "Emulated capacity in MiB when data_mode != 0 (default: memmap size)");
+module_param(gc_policy, uint, 0444);
+MODULE_PARM_DESC(gc_policy, "GC victim selection: 0=greedy, 1=cost-benefit, 2=windowed greedy, 3=RUH-aware");
+module_param(bg_gc_lines, uint, 0444);
+MODULE_PARM_DESC(bg_gc_lines, "Free lines background GC keeps above the foreground threshold (0: disabled)");
+module_param(bg_gc_idle_us, uint, 0444);
+MODULE_PARM_DESC(bg_gc_idle_us, "Host idle time in usecs after which background GC also reclaims cheap victims");
+module_param(gc_incremental, uint, 0444);
+MODULE_PARM_DESC(gc_incremental, "Collect victims one flash-page row at a time, interleaved with host writes");
+module_param(gc_copy_ratio, uint, 0444);
+MODULE_PARM_DESC(gc_copy_ratio, "Incremental GC: pages copied per 100 host pages written (0: vpc/ipc of the victim)");
+module_param(gc_streams, uint, 0444);
+MODULE_PARM_DESC(gc_streams, "GC destination: 0=single stream, 1=one per RUH, 2=by age class");
+module_param(nand_sched, uint, 0444);
+MODULE_PARM_DESC(nand_sched, "Per-die NAND scheduling: 0=FCFS, 1=read-first, 2=GC-deprioritized, 3=weighted");
+module_param(nand_sched_weight, uint, 0444);
+MODULE_PARM_DESC(nand_sched_weight, "Weighted NAND scheduling: times a queued operation may be passed");
+module_param(pcie_mps, uint, 0444);
+MODULE_PARM_DESC(pcie_mps, "PCIe max payload size in bytes, 128 to 4096");
+module_param(read_ahead_kb, uint, 0444);
+MODULE_PARM_DESC(read_ahead_kb, "Read-ahead window for sequential read streams in KiB (0: disabled)");
+module_param(map_cache_kb, uint, 0444);
+MODULE_PARM_DESC(map_cache_kb, "DRAM for the mapping table in KiB, misses are read from NAND (0: whole table in DRAM)");
+module_param(map_seg_kb, uint, 0444);
+MODULE_PARM_DESC(map_seg_kb, "Mapping table segment, the unit cached and read from NAND, in KiB");
+module_param(slc_lines, uint, 0444);
+MODULE_PARM_DESC(slc_lines, "Lines per partition set aside as SLC write cache (0: write TLC directly)");
+module_param(snapshot_size, ulong, 0444);
+MODULE_PARM_DESC(snapshot_size, "Size in MiB reserved at the tail of memmap for FTL snapshots (0: disabled)");
 
 static void nvmev_proc_dbs(unsigned int id)
 {
@@ -284,6 +337,54 @@ static int __validate_configs(void)
 		return -EINVAL;
 	}
 
+	if (data_mode > DATA_MODE_NONE) {
+		NVMEV_ERROR("[data_mode] should be 0, 1 or 2\n");
+		return -EINVAL;
+	}
+
+#if (CSD_ENABLE == 1)
+	/* namespace copies and the partition map read the backing directly */
+	if (data_mode != DATA_MODE_FULL) {
+		NVMEV_ERROR("[data_mode] should be 0 with CSD enabled\n");
+		return -EINVAL;
+	}
+#endif
+
+	if (emul_size && data_mode == DATA_MODE_FULL) {
+		NVMEV_ERROR("[emul_size] is ignored unless data_mode is 1 or 2\n");
+		emul_size = 0;
+	}
+
+	if (gc_policy >= NR_GC_POLICIES) {
+		NVMEV_ERROR("[gc_policy] should be 0 to %d\n", NR_GC_POLICIES - 1);
+		return -EINVAL;
+	}
+
+	if (gc_streams >= NR_GC_STREAM_MODES) {
+		NVMEV_ERROR("[gc_streams] should be 0 to %d\n", NR_GC_STREAM_MODES - 1);
+		return -EINVAL;
+	}
+
+	if (nand_sched >= NR_NAND_SCHEDS) {
+		NVMEV_ERROR("[nand_sched] should be 0 to %d\n", NR_NAND_SCHEDS - 1);
+		return -EINVAL;
+	}
+
+	if (pcie_mps < 128 || pcie_mps > 4096 || !is_power_of_2(pcie_mps)) {
+		NVMEV_ERROR("[pcie_mps] should be a power of 2 from 128 to 4096\n");
+		return -EINVAL;
+	}
+
+	if (map_seg_kb == 0 || map_seg_kb > 64) {
+		NVMEV_ERROR("[map_seg_kb] should be 1 to 64\n");
+		return -EINVAL;
+	}
+
+	if (snapshot_size >= memmap_size - slm_size - 1) {
+		NVMEV_ERROR("[snapshot_size] should be smaller than the storage area\n");
+		return -EINVAL;
+	}
+
 	return 0;
 }
 
@@ -319,6 +420,13 @@ static int __get_nr_entries(int dbs_idx, int queue_size)
 	return diff;
 }
 
+static const char *const gc_policy_names[NR_GC_POLICIES] = {
+	[GC_POLICY_GREEDY] = "greedy",
+	[GC_POLICY_COST_BENEFIT] = "cost-benefit",
+	[GC_POLICY_WINDOWED] = "windowed",
+	[GC_POLICY_RUH_AWARE] = "ruh-aware",
+};
+
 static int __proc_file_read(struct seq_file *m, void *data)
 {
 	const char *filename = m->private;
@@ -355,7 +463,62 @@ static int __proc_file_read(struct seq_file *m, void *data)
 		}
 		seq_printf(m, "total: %u %u %u %llu\n", nr_in_flight, nr_dispatch, nr_dispatched, total_io);
 	} else if (strcmp(filename, "debug") == 0) {
-		/* Left for later use */
+		struct conv_map_stat stat = { 0 }, part;
+		struct conv_slc_stat slc = { 0 }, slc_part;
+		int i;
+
+		/* cached mapping table (map_cache_kb) and SLC cache (slc_lines) */
+		for (i = 0; i < vdev->nr_ns; i++) {
+			if (NS_SSD_TYPE(i) != SSD_TYPE_CONV)
+				continue;
+			conv_map_stats(&vdev->ns[i], &part);
+			stat.hits += part.hits;
+			stat.misses += part.misses;
+			stat.dirty_evicts += part.dirty_evicts;
+
+			conv_slc_stats(&vdev->ns[i], &slc_part);
+			slc.nr_cached += slc_part.nr_cached;
+			slc.capacity += slc_part.capacity;
+			slc.written += slc_part.written;
+			slc.folded += slc_part.folded;
+			slc.dropped += slc_part.dropped;
+			slc.forced += slc_part.forced;
+		}
+		seq_printf(m, "map cache: hits %llu misses %llu dirty evictions %llu\n", stat.hits, stat.misses,
+				   stat.dirty_evicts);
+		seq_printf(m, "slc cache: %u/%u wordlines, written %llu folded %llu dropped %llu forced %llu\n",
+				   slc.nr_cached, slc.capacity, slc.written, slc.folded, slc.dropped, slc.forced);
+	} else if (strcmp(filename, "precondition") == 0) {
+		seq_printf(m, "seq <fill%%> [<nr_ruh>]\n");
+		seq_printf(m, "rand <fill%%> <overwrite%% of RUH 0> [<overwrite%% of RUH 1> ...]\n");
+	} else if (strcmp(filename, "gc_policy") == 0) {
+		int i, p;
+
+		for (p = 0; p < NR_GC_POLICIES; p++)
+			seq_printf(m, "%s%s%s ", (p == cfg->gc_policy) ? "[" : "", gc_policy_names[p],
+					   (p == cfg->gc_policy) ? "]" : "");
+		seq_printf(m, "\n");
+
+		/* host and GC pages programmed while each policy was active */
+		for (p = 0; p < NR_GC_POLICIES; p++) {
+			struct conv_gc_stat stat = { 0 }, part;
+			uint64_t waf_x1000;
+
+			for (i = 0; i < vdev->nr_ns; i++) {
+				if (NS_SSD_TYPE(i) != SSD_TYPE_CONV)
+					continue;
+				conv_gc_stats(&vdev->ns[i], p, &part);
+				stat.host_pgs += part.host_pgs;
+				stat.gc_pgs += part.gc_pgs;
+			}
+
+			waf_x1000 = stat.host_pgs ? (stat.host_pgs + stat.gc_pgs) * 1000 / stat.host_pgs : 0;
+			seq_printf(m, "%s: host %llu gc %llu waf %llu.%03llu\n", gc_policy_names[p], stat.host_pgs,
+					   stat.gc_pgs, waf_x1000 / 1000, waf_x1000 % 1000);
+		}
+	} else if (strcmp(filename, "snapshot") == 0) {
+		seq_printf(m, "reserved: %lu MiB\n", BYTE_TO_MB(cfg->snapshot_size));
+		seq_printf(m, "save | drop\n");
 	} else if (strcmp(filename, "freebie") == 0) {
 		seq_printf(m, "%llu %llu %llu %llu\n",
 			atomic64_read(&vdev->repartition_command_count), atomic64_read(&vdev->repartition_command_success_count),
@@ -387,6 +550,126 @@ static int __proc_file_read(struct seq_file *m, void *data)
 	return 0;
 }
 
+/* "<policy name>" switches the policy, "reset" clears the WAF counters */
+static int __proc_gc_policy(char *input)
+{
+	char *cmd = strim(input);
+	int i;
+
+	if (!strcmp(cmd, "reset")) {
+		for (i = 0; i < vdev->nr_ns; i++) {
+			if (NS_SSD_TYPE(i) == SSD_TYPE_CONV)
+				conv_gc_stats_reset(&vdev->ns[i]);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < NR_GC_POLICIES; i++) {
+		if (!strcmp(cmd, gc_policy_names[i])) {
+			WRITE_ONCE(vdev->config.gc_policy, i);
+			NVMEV_INFO("GC policy: %s\n", gc_policy_names[i]);
+			return 0;
+		}
+	}
+
+	return -EINVAL;
+}
+
+/* "seq <fill%> [<nr_ruh>]" or "rand <fill%> <overwrite%> [<overwrite%> ...]" */
+static int __proc_precondition(char *input)
+{
+	struct conv_precond_spec spec = { 0 };
+	char *args = strim(input);
+	char *tok = strsep(&args, " ");
+	int i, err;
+
+	if (!strcmp(tok, "seq"))
+		spec.mode = PRECOND_SEQ;
+	else if (!strcmp(tok, "rand"))
+		spec.mode = PRECOND_RAND;
+	else
+		return -EINVAL;
+
+	tok = strsep(&args, " ");
+	if (!tok)
+		return -EINVAL;
+	spec.fill_pcent = simple_strtoul(tok, NULL, 10);
+
+	if (spec.mode == PRECOND_SEQ) {
+		tok = strsep(&args, " ");
+		spec.nr_ruh = tok ? simple_strtoul(tok, NULL, 10) : 1;
+	} else {
+		while ((tok = strsep(&args, " ")) != NULL && spec.nr_ruh < NR_MAX_RUH) {
+			if (*tok == '\0')
+				continue;
+			spec.overwrite_pcent[spec.nr_ruh++] = simple_strtoul(tok, NULL, 10);
+		}
+	}
+
+	for (i = 0; i < vdev->nr_ns; i++) {
+		if (NS_SSD_TYPE(i) != SSD_TYPE_CONV)
+			continue;
+
+		err = conv_precondition(&vdev->ns[i], &spec);
+		if (err) {
+			NVMEV_ERROR("precondition failed on ns %d (%d)\n", i, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Conventional namespaces are laid out back to back in the snapshot area.
+ * Saving requires the device to be idle; the caller takes care of that.
+ */
+static int __snapshot_save(void)
+{
+	void *pos = vdev->snapshot_mapped;
+	size_t remaining = vdev->config.snapshot_size;
+	int i, err;
+
+	if (!pos)
+		return -ENODEV;
+
+	for (i = 0; i < vdev->nr_ns; i++) {
+		if (NS_SSD_TYPE(i) != SSD_TYPE_CONV)
+			continue;
+
+		err = conv_snapshot_save(&vdev->ns[i], pos, remaining);
+		if (err)
+			return err;
+
+		pos += conv_snapshot_size(&vdev->ns[i]);
+		remaining -= conv_snapshot_size(&vdev->ns[i]);
+	}
+
+	return 0;
+}
+
+static void __snapshot_load(void)
+{
+	void *pos = vdev->snapshot_mapped;
+	size_t remaining = vdev->config.snapshot_size;
+	int i;
+
+	if (!pos)
+		return;
+
+	for (i = 0; i < vdev->nr_ns; i++) {
+		if (NS_SSD_TYPE(i) != SSD_TYPE_CONV)
+			continue;
+
+		if (remaining < conv_snapshot_size(&vdev->ns[i]) ||
+			conv_snapshot_load(&vdev->ns[i], pos, remaining) != 0)
+			return;
+
+		pos += conv_snapshot_size(&vdev->ns[i]);
+		remaining -= conv_snapshot_size(&vdev->ns[i]);
+	}
+}
+
 static ssize_t __proc_file_write(struct file *file, const char __user *buf, size_t len, loff_t *offp)
 {
 	ssize_t count = len;
@@ -398,6 +681,7 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 	size_t nr_copied;
 
 	nr_copied = copy_from_user(input, buf, min(len, sizeof(input)));
+	input[min(len, sizeof(input) - 1)] = '\0';
 
 	if (!strcmp(filename, "read_times")) {
 		ret = sscanf(input, "%u %u %u", &cfg->read_delay, &cfg->read_time, &cfg->read_trailing);
@@ -428,6 +712,26 @@ static ssize_t __proc_file_write(struct file *file, const char __user *buf, size
 		}
 	} else if (!strcmp(filename, "debug")) {
 		/* Left for later use */
+	} else if (!strcmp(filename, "precondition")) {
+		int err = __proc_precondition(input);
+		if (err)
+			return err;
+	} else if (!strcmp(filename, "gc_policy")) {
+		int err = __proc_gc_policy(input);
+		if (err)
+			return err;
+	} else if (!strcmp(filename, "snapshot")) {
+		char *cmd = strim(input);
+		int err = -EINVAL;
+
+		if (!strcmp(cmd, "save")) {
+			err = __snapshot_save();
+		} else if (!strcmp(cmd, "drop") && vdev->snapshot_mapped) {
+			memset(vdev->snapshot_mapped, 0, PAGE_SIZE);
+			err = 0;
+		}
+		if (err)
+			return err;
 	} else if (!strcmp(filename, "ebpf")) {
 #ifdef CSD_eBPF_ENABLE
 #if (CSD_eBPF_ENABLE == 1)
@@ -493,6 +797,13 @@ void NVMEV_STORAGE_INIT(struct nvmev_dev *vdev)
 	if (vdev->storage_mapped == NULL)
 		NVMEV_ERROR("Failed to map storage memory.\n");
 
+	if (vdev->config.snapshot_size) {
+		NVMEV_INFO("Snapshot : %lx + %lx\n", vdev->config.snapshot_start, vdev->config.snapshot_size);
+		vdev->snapshot_mapped = memremap(vdev->config.snapshot_start, vdev->config.snapshot_size, MEMREMAP_WB);
+		if (vdev->snapshot_mapped == NULL)
+			NVMEV_ERROR("Failed to map snapshot memory.\n");
+	}
+
 	vdev->proc_root = proc_mkdir("nvmev", NULL);
 	vdev->proc_read_times = proc_create("read_times", 0664, vdev->proc_root, &proc_file_fops);
 	vdev->proc_write_times = proc_create("write_times", 0664, vdev->proc_root, &proc_file_fops);
@@ -501,6 +812,9 @@ void NVMEV_STORAGE_INIT(struct nvmev_dev *vdev)
 	vdev->proc_debug = proc_create("debug", 0444, vdev->proc_root, &proc_file_fops);
 	vdev->proc_ebpf = proc_create("ebpf", 0664, vdev->proc_root, &proc_file_fops);
 	vdev->proc_ebpf = proc_create("freebie", 0664, vdev->proc_root, &proc_file_fops);
+	vdev->proc_precondition = proc_create("precondition", 0664, vdev->proc_root, &proc_file_fops);
+	vdev->proc_snapshot = proc_create("snapshot", 0664, vdev->proc_root, &proc_file_fops);
+	vdev->proc_gc_policy = proc_create("gc_policy", 0664, vdev->proc_root, &proc_file_fops);
 }
 
 void NVMEV_STORAGE_FINAL(struct nvmev_dev *vdev)
@@ -512,6 +826,9 @@ void NVMEV_STORAGE_FINAL(struct nvmev_dev *vdev)
 	remove_proc_entry("debug", vdev->proc_root);
 	remove_proc_entry("ebpf", vdev->proc_root);
 	remove_proc_entry("freebie", vdev->proc_root);
+	remove_proc_entry("precondition", vdev->proc_root);
+	remove_proc_entry("snapshot", vdev->proc_root);
+	remove_proc_entry("gc_policy", vdev->proc_root);
 
 	remove_proc_entry("nvmev", NULL);
 
@@ -523,6 +840,9 @@ void NVMEV_STORAGE_FINAL(struct nvmev_dev *vdev)
 	if (vdev->storage_mapped)
 		memunmap(vdev->storage_mapped);
 
+	if (vdev->snapshot_mapped)
+		memunmap(vdev->snapshot_mapped);
+
 	if (vdev->io_unit_stat)
 		kfree(vdev->io_unit_stat);
 }
@@ -551,6 +871,27 @@ static bool __load_configs(struct nvmev_config *config)
 	config->storage_start = config->memmap_start + (1UL << 20);
 	config->storage_size = (memmap_size - 1) << 20;
 #endif
+	/* FTL snapshots live past the end of the storage area */
+	config->snapshot_size = snapshot_size << 20;
+	config->storage_size -= config->snapshot_size;
+	config->snapshot_start = config->storage_start + config->storage_size;
+
+	config->data_mode = data_mode;
+	config->gc_policy = gc_policy;
+	config->bg_gc_lines = bg_gc_lines;
+	config->bg_gc_idle_us = bg_gc_idle_us;
+	config->gc_incremental = gc_incremental;
+	config->gc_copy_ratio = gc_copy_ratio;
+	config->gc_streams = gc_streams;
+	config->nand_sched = nand_sched;
+	config->nand_sched_weight = nand_sched_weight;
+	config->pcie_mps = pcie_mps;
+	config->read_ahead_kb = read_ahead_kb;
+	config->map_cache_kb = map_cache_kb;
+	config->map_seg_kb = map_seg_kb;
+	config->slc_lines = slc_lines;
+	config->emul_size = emul_size << 20;
+
 	config->read_time = read_time;
 	config->read_delay = read_delay;
 	config->read_trailing = read_trailing;
@@ -575,6 +916,13 @@ static bool __load_configs(struct nvmev_config *config)
 		config->nr_io_cpu++;
 	}
 
+	config->nr_ftl_cpu = 0;
+	while ((cpu = strsep(&ftl_cpus, ",")) != NULL) {
+		cpu_nr = (unsigned int)simple_strtol(cpu, NULL, 10);
+		config->cpu_nr_ftl[config->nr_ftl_cpu] = cpu_nr;
+		config->nr_ftl_cpu++;
+	}
+
 #if (CSD_ENABLE == 1)
 	config->nr_csd_cpu = 0;
 	int count = 0;
@@ -603,6 +951,7 @@ static bool __load_configs(struct nvmev_config *config)
 void NVMEV_NAMESPACE_INIT(struct nvmev_dev *vdev)
 {
 	unsigned long long remaining_capacity = vdev->config.storage_size; // byte
+	const bool data_less = (vdev->config.data_mode != DATA_MODE_FULL);
 	void *ns_addr = vdev->storage_mapped;
 	const int nr_ns = NR_NAMESPACES;
 	const unsigned int disp_no = vdev->config.cpu_nr_dispatcher[0];
@@ -611,6 +960,10 @@ void NVMEV_NAMESPACE_INIT(struct nvmev_dev *vdev)
 
 	struct nvmev_ns *ns = kmalloc_node(sizeof(struct nvmev_ns) * nr_ns, GFP_KERNEL, 1);
 
+	/* Without payload storage, the emulated capacity is decoupled from memmap */
+	if (data_less && vdev->config.emul_size)
+		remaining_capacity = vdev->config.emul_size;
+
 	for (i = 0; i < nr_ns; i++) {
 		if (NS_CAPACITY(i) == 0)
 			size = remaining_capacity;
@@ -625,7 +978,9 @@ void NVMEV_NAMESPACE_INIT(struct nvmev_dev *vdev)
 			NVMEV_ASSERT(0);
 
 		remaining_capacity -= size;
-		ns_addr += size;
+		/* namespaces share the whole storage area when it is not 1:1 */
+		if (!data_less)
+			ns_addr += size;
 		NVMEV_INFO("[%s] ns=%d ns_addr=%p ns_size=%lld(MiB) \n", __FUNCTION__, i, ns[i].mapped, BYTE_TO_MB(ns[i].size));
 
 		ns->notify_io_cmd = NULL;
@@ -671,6 +1026,7 @@ static int NVMeV_init(void)
 	NVMEV_STORAGE_INIT(vdev);
 
 	NVMEV_NAMESPACE_INIT(vdev);
+	__snapshot_load();
 
 	if (io_using_dma) {
 		if (ioat_dma_chan_set("dma4chan0") != 0) {
@@ -708,6 +1064,7 @@ static int NVMeV_init(void)
 	atomic64_set(&vdev->host_write, 0);
 	atomic64_set(&vdev->gc_read, 0);
 	atomic64_set(&vdev->gc_write, 0);
+	atomic64_set(&vdev->media_erase, 0);
 	atomic64_set(&vdev->repartition_map_read, 0);
 
 	for (int i = 0; i < 16; i++) {
@@ -737,6 +1094,9 @@ static void NVMeV_exit(void)
 #if (CSD_ENABLE == 1)
 	NVMEV_CSD_PROC_FINAL(vdev);
 #endif
+	/* all I/O threads are gone, the FTL is quiescent */
+	if (vdev->snapshot_mapped)
+		__snapshot_save();
 	NVMEV_NAMESPACE_FINAL(vdev);
 	NVMEV_STORAGE_FINAL(vdev);
 
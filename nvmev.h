@@ -18,6 +18,7 @@
 #include <linux/pci.h>
 #include <linux/msi.h>
 #include <asm/apic.h>
+#include <linux/timekeeping.h>
 
 #include "nvme.h"
 #include "ssd_config.h"
@@ -32,6 +33,17 @@
 
 #define SUPPORT_MULTI_IO_WORKER_BY_SQ 0
 
+/*
+ * Emulator time, in ns. All dispatchers, workers and FTL threads read the
+ * same clock: CLOCK_MONOTONIC is a seqcount-protected base over the
+ * calibrated TSC, so it is cheap on any CPU and never goes backwards
+ * between CPUs, unlike cpu_clock() of a remote CPU or local_clock().
+ */
+static inline uint64_t nvmev_clock(void)
+{
+	return ktime_get_ns();
+}
+
 /*************************/
 #define NVMEV_DRV_NAME "NVMeVirt"
 #define NVMEV_VERSION 0x0110
@@ -141,6 +153,13 @@ struct nvmev_admin_queue {
 #define SQ_ENTRY_TO_PAGE_OFFSET(entry_id) (entry_id % NR_SQE_PER_PAGE)
 #define CQ_ENTRY_TO_PAGE_OFFSET(entry_id) (entry_id % NR_CQE_PER_PAGE)
 
+/* How the payload of I/O commands is backed (data_mode module parameter) */
+enum {
+	DATA_MODE_FULL = 0, /* stored at its LBA offset in the storage area */
+	DATA_MODE_FOLD = 1, /* folded into the storage area by LBA modulo its size */
+	DATA_MODE_NONE = 2, /* writes are discarded, reads return zeroes */
+};
+
 struct nvmev_config {
 	unsigned long memmap_start; // byte
 	unsigned long memmap_size; // byte
@@ -151,6 +170,26 @@ struct nvmev_config {
 	unsigned long storage_start; //byte
 	unsigned long storage_size; // byte
 
+	unsigned int data_mode;
+	unsigned long emul_size; // byte, capacity exposed when data_mode != DATA_MODE_FULL
+
+	unsigned int gc_policy; // GC_POLICY_*
+	unsigned int bg_gc_lines; // free lines kept above the foreground GC threshold, 0: no background GC
+	unsigned int bg_gc_idle_us;
+	unsigned int gc_incremental;
+	unsigned int gc_copy_ratio; // pages copied per 100 host pages, 0: auto
+	unsigned int gc_streams; // GC_STREAM_*
+	unsigned int nand_sched; // NAND_SCHED_*
+	unsigned int nand_sched_weight;
+	unsigned int pcie_mps; // bytes
+	unsigned int read_ahead_kb; // 0: no read-ahead
+	unsigned int map_cache_kb; // DRAM for the mapping table, 0: all of it
+	unsigned int map_seg_kb; // mapping table segment
+	unsigned int slc_lines; // per partition, 0: no SLC cache
+
+	unsigned long snapshot_start; // byte, FTL snapshot area at the tail of memmap
+	unsigned long snapshot_size; // byte
+
 	unsigned int read_delay; // ns
 	unsigned int read_time; // ns
 	unsigned int read_trailing; // ns
@@ -165,6 +204,8 @@ struct nvmev_config {
 	unsigned int cpu_nr_dispatcher[8];
 	unsigned int nr_io_cpu;
 	unsigned int cpu_nr_proc_io[32];
+	unsigned int nr_ftl_cpu;
+	unsigned int cpu_nr_ftl[32];
 	unsigned int cpu_nr_csd_dispatcher[2];
 	unsigned int nr_csd_cpu;
 	unsigned int cpu_nr_csd[32];
@@ -195,10 +236,6 @@ struct nvmev_proc_table {
 	unsigned int result0;
 	unsigned int result1;
 
-	bool writeback_cmd;
-	void *write_buffer;
-	unsigned int buffs_to_release;
-
 	bool gc_cmd;
 	bool is_gc_write;
 	unsigned int gc_io_length;
@@ -247,6 +284,7 @@ struct nvmev_dev {
 
 	void *slm_mapped;
 	void *storage_mapped;
+	void *snapshot_mapped;
 
 	struct nvmev_proc_info *proc_info;
 	unsigned int proc_turn;
@@ -276,6 +314,9 @@ struct nvmev_dev {
 	struct proc_dir_entry *proc_debug;
 	struct proc_dir_entry *proc_ebpf;
 	struct proc_dir_entry *proc_freebie;
+	struct proc_dir_entry *proc_precondition;
+	struct proc_dir_entry *proc_snapshot;
+	struct proc_dir_entry *proc_gc_policy;
 
 	unsigned long long *io_unit_stat;
 
@@ -300,6 +341,7 @@ struct nvmev_dev {
 
 	atomic64_t gc_read;
 	atomic64_t gc_write;
+	atomic64_t media_erase;
 
 	atomic64_t repartition_map_read;
 
@@ -21,7 +21,7 @@ extern struct nvmev_dev *vdev;
 
 static inline unsigned long long __get_wallclock(void)
 {
-	return cpu_clock(vdev->config.cpu_nr_dispatcher[0]);
+	return nvmev_clock();
 }
 
 static size_t __cmd_io_size(struct nvme_rw_command *cmd)
@@ -12,6 +12,8 @@
  *
  **********************************************************************/
 
+#include <linux/completion.h>
+#include <linux/kthread.h>
 #include <linux/ktime.h>
 #include <linux/sched/clock.h>
 #include <linux/vmalloc.h>
@@ -24,70 +26,153 @@ atomic64_t g_buffer_allocate_bytes = ATOMIC64_INIT(0);
 atomic64_t g_buffer_enqueue_bytes = ATOMIC64_INIT(0);
 atomic64_t g_buffer_release_bytes = ATOMIC64_INIT(0);
 atomic64_t g_last_pg_in_wordline_bytes = ATOMIC64_INIT(0);
+atomic64_t g_buffer_wait_ns = ATOMIC64_INIT(0);
 #define BUFFER_PRINT_INTERVAL (4ULL * 1024 * 1024 * 1024) /* 4GB */
 
+extern struct nvmev_dev *vdev;
+
 static inline uint64_t __get_ioclock(struct ssd *ssd)
 {
-	return cpu_clock(ssd->cpu_nr_dispatcher);
+	return nvmev_clock();
 }
 
 void buffer_init(struct buffer *buf, uint32_t size)
 {
-	spin_lock_init(&buf->lock);
 	buf->initial = size;
-	buf->remaining = size;
+	spin_lock_init(&buf->lock);
+	buf->free = size;
+	/* every writeback returns at least a page */
+	buf->max_wb = DIV_ROUND_UP(size, PAGE_SIZE);
+	buf->wb = vmalloc_node(sizeof(struct buffer_wb) * buf->max_wb, 1);
+	buf->nr_wb = 0;
+}
+
+void buffer_remove(struct buffer *buf)
+{
+	vfree(buf->wb);
 }
 
-uint32_t buffer_allocate(struct buffer *buf, uint32_t size)
+static void __buffer_wb_push(struct buffer *buf, uint64_t etime, uint32_t bytes)
 {
-	uint64_t total;
+	uint32_t i = buf->nr_wb++;
 
-	while (!spin_trylock(&buf->lock)) {
-		cpu_relax();
+	while (i > 0 && buf->wb[(i - 1) / 2].etime > etime) {
+		buf->wb[i] = buf->wb[(i - 1) / 2];
+		i = (i - 1) / 2;
 	}
+	buf->wb[i] = (struct buffer_wb){ .etime = etime, .bytes = bytes };
+}
 
-	if (buf->remaining < size) {
-		uint32_t curr_remaining = buf->remaining;
-		spin_unlock(&buf->lock);
-		NVMEV_ERROR("BUFFER_ALLOC_FAIL: remaining=%u requested=%u initial=%u\n",
-			curr_remaining, size, buf->initial);
-		return 0;
+/* retire the earliest writeback, its bytes are free again */
+static void __buffer_wb_pop(struct buffer *buf)
+{
+	struct buffer_wb last = buf->wb[--buf->nr_wb];
+	uint32_t i = 0, child;
+
+	buf->free += buf->wb[0].bytes;
+	atomic64_add(buf->wb[0].bytes, &g_buffer_release_bytes);
+
+	while ((child = 2 * i + 1) < buf->nr_wb) {
+		if (child + 1 < buf->nr_wb && buf->wb[child + 1].etime < buf->wb[child].etime)
+			child++;
+		if (last.etime <= buf->wb[child].etime)
+			break;
+		buf->wb[i] = buf->wb[child];
+		i = child;
+	}
+	if (buf->nr_wb > 0)
+		buf->wb[i] = last;
+}
+
+/*
+ * Take size bytes of the write buffer at *nsecs_start. If the buffer is full
+ * then, the write waits for the earliest writebacks in flight, the way a
+ * drive throttles the host, and *nsecs_start is pushed to the completion of
+ * the one that frees enough space. Fails only if size exceeds the whole
+ * buffer.
+ */
+bool buffer_allocate(struct buffer *buf, uint32_t size, uint64_t *nsecs_start)
+{
+	uint64_t ready = *nsecs_start, total;
+
+	if (size > buf->initial) {
+		NVMEV_ERROR("BUFFER_ALLOC_FAIL: requested=%u initial=%u\n", size, buf->initial);
+		return false;
 	}
 
-	buf->remaining -= size;
+	spin_lock(&buf->lock);
+	while (buf->nr_wb > 0 && buf->wb[0].etime <= ready)
+		__buffer_wb_pop(buf);
+	while (buf->free < size && buf->nr_wb > 0) {
+		ready = buf->wb[0].etime;
+		__buffer_wb_pop(buf);
+	}
+	/*
+	 * Space held by wordlines that are not full yet has no writeback to
+	 * wait for; the write then goes ahead and overcommits.
+	 */
+	buf->free -= size;
 	spin_unlock(&buf->lock);
 
+	if (ready > *nsecs_start) {
+		atomic64_add(ready - *nsecs_start, &g_buffer_wait_ns);
+		*nsecs_start = ready;
+	}
+
 	total = atomic64_add_return(size, &g_buffer_allocate_bytes);
 	if ((total % BUFFER_PRINT_INTERVAL) < size) {
-		NVMEV_INFO("BUFFER_TRACK: allocate=%llu enqueue=%llu lastpg=%llu release=%llu (GB)\n",
+		NVMEV_INFO("BUFFER_TRACK: allocate=%llu enqueue=%llu lastpg=%llu release=%llu (GB) wait=%llu ms\n",
 			total >> 30,
 			atomic64_read(&g_buffer_enqueue_bytes) >> 30,
 			atomic64_read(&g_last_pg_in_wordline_bytes) >> 30,
-			atomic64_read(&g_buffer_release_bytes) >> 30);
+			atomic64_read(&g_buffer_release_bytes) >> 30,
+			atomic64_read(&g_buffer_wait_ns) / 1000000);
 	}
 
-	return size;
+	return true;
 }
 
+/* give back space that no writeback will return, e.g. of a failed write */
 bool buffer_release(struct buffer *buf, uint32_t size)
 {
-	while (!spin_trylock(&buf->lock));
-	buf->remaining += size;
+	spin_lock(&buf->lock);
+	buf->free += size;
 	spin_unlock(&buf->lock);
-
 	atomic64_add(size, &g_buffer_release_bytes);
 
 	return true;
 }
 
+/* size bytes are written back by a program that completes at etime */
+void buffer_release_at(struct buffer *buf, uint64_t etime, uint32_t size)
+{
+	atomic64_add(size, &g_buffer_enqueue_bytes);
+
+	spin_lock(&buf->lock);
+	if (buf->nr_wb < buf->max_wb) {
+		__buffer_wb_push(buf, etime, size);
+		spin_unlock(&buf->lock);
+		return;
+	}
+	spin_unlock(&buf->lock);
+
+	buffer_release(buf, size);
+}
+
 void buffer_refill(struct buffer *buf)
 {
-	while (!spin_trylock(&buf->lock))
-		;
-	buf->remaining = buf->initial;
+	spin_lock(&buf->lock);
+	buf->free = buf->initial;
+	buf->nr_wb = 0;
 	spin_unlock(&buf->lock);
 }
 
+/* two page bitmaps followed by the per-page RUH tags */
+static size_t blk_meta_size(uint32_t npgs)
+{
+	return BITS_TO_LONGS(npgs) * sizeof(unsigned long) * 2 + npgs;
+}
+
 static void check_params(struct ssdparams *spp)
 {
 	/*
@@ -147,17 +232,27 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 	spp->pg_rd_lat[CELL_TYPE_MSB] = NAND_READ_LATENCY_MSB;
 	spp->pg_rd_lat[CELL_TYPE_CSB] = NAND_READ_LATENCY_CSB;
 	spp->pg_wr_lat = NAND_PROG_LATENCY;
+	spp->slc_wr_lat = NAND_SLC_PROG_LATENCY * CELL_MODE;
 	spp->blk_er_lat = NAND_ERASE_LATENCY;
+	spp->pe_suspend_lat = NAND_SUSPEND_LATENCY;
+	spp->pe_resume_lat = NAND_RESUME_LATENCY;
+	spp->max_pe_suspends = NAND_MAX_SUSPENDS;
+	spp->nand_sched = vdev->config.nand_sched;
+	spp->nand_sched_weight = vdev->config.nand_sched_weight;
 	spp->max_ch_xfer_size = MAX_CH_XFER_SIZE;
 
 	spp->fw_4kb_rd_lat = FW_4KB_READ_LATENCY;
 	spp->fw_rd_lat = FW_READ_LATENCY;
+	spp->fw_cache_rd_lat = FW_CACHE_READ_LATENCY;
 	spp->fw_ch_xfer_lat = FW_CH_XFER_LATENCY;
 	spp->fw_wbuf_lat0 = FW_WBUF_LATENCY0;
 	spp->fw_wbuf_lat1 = FW_WBUF_LATENCY1;
 
 	spp->ch_bandwidth = NAND_CHANNEL_BANDWIDTH;
 	spp->pcie_bandwidth = PCIE_BANDWIDTH;
+	spp->pcie_mps = vdev->config.pcie_mps;
+	spp->pcie_tlp_overhead[PCIE_H2D] = PCIE_H2D_TLP_OVERHEAD;
+	spp->pcie_tlp_overhead[PCIE_D2H] = PCIE_D2H_TLP_OVERHEAD;
 
 	spp->write_buffer_size = WRITE_BUFFER_SIZE;
 	spp->write_early_completion = WRITE_EARLY_COMPLETION;
@@ -184,10 +279,11 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 	spp->tt_luns = spp->luns_per_ch * spp->nchs;
 
 	/* line is special, put it at the end */
-	spp->blks_per_line = spp->tt_luns; /* TODO: to fix under multiplanes */
+	/* a line is block i of every plane, programmed multi-plane on each die */
+	spp->blks_per_line = spp->tt_pls;
 	spp->pgs_per_line = spp->blks_per_line * spp->pgs_per_blk;
 	spp->secs_per_line = spp->pgs_per_line * spp->secs_per_pg;
-	spp->tt_lines = spp->blks_per_lun; /* TODO: to fix under multiplanes */ // lun size is super-block(line) size
+	spp->tt_lines = spp->blks_per_pl;
 
 	check_params(spp);
 
@@ -200,47 +296,45 @@ void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts)
 		BYTE_TO_MB(spp->pgs_per_line * spp->pgsz), BYTE_TO_KB(spp->pgs_per_line * spp->pgsz));
 	NVMEV_INFO("SSD params: tt_pgs=%lu pgs_per_blk=%d blks_per_pl=%d luns_per_ch=%d pls_per_lun=%d",
 			   spp->tt_pgs, spp->pgs_per_blk, spp->blks_per_pl, spp->luns_per_ch, spp->pls_per_lun);
+	NVMEV_INFO("Page state metadata: %lu KiB per block, up to %llu MiB (allocated when a line is opened)\n",
+			   BYTE_TO_KB(blk_meta_size(spp->pgs_per_blk)),
+			   BYTE_TO_MB((uint64_t)blk_meta_size(spp->pgs_per_blk) * spp->tt_blks));
 }
 
-static void ssd_init_nand_page(struct nand_page *pg, struct ssdparams *spp)
+int ssd_materialize_blk(struct nand_block *blk)
 {
-	int i;
-	pg->nsecs = spp->secs_per_pg;
-	pg->sec = kmalloc_node(sizeof(nand_sec_status_t) * pg->nsecs, GFP_KERNEL, 1);
-	for (i = 0; i < pg->nsecs; i++) {
-		pg->sec[i] = SEC_FREE;
-	}
-	pg->status = PG_FREE;
-	pg->ruh = -1;
-}
+	size_t bitmap_longs = BITS_TO_LONGS(blk->npgs);
 
-static void ssd_remove_nand_page(struct nand_page *pg)
-{
-	kfree(pg->sec);
+	if (blk->pg_written)
+		return 0;
+
+	blk->pg_written = kvmalloc_node(blk_meta_size(blk->npgs), GFP_KERNEL, 1);
+	if (!blk->pg_written)
+		return -ENOMEM;
+	blk->pg_valid = blk->pg_written + bitmap_longs;
+	blk->pg_ruh = (uint8_t *)(blk->pg_valid + bitmap_longs);
+	reset_blk_pgs(blk);
+	return 0;
 }
 
 static void ssd_init_nand_blk(struct nand_block *blk, struct ssdparams *spp)
 {
-	int i;
 	blk->npgs = spp->pgs_per_blk;
-	blk->pg = kmalloc_node(sizeof(struct nand_page) * blk->npgs, GFP_KERNEL, 1);
-	for (i = 0; i < blk->npgs; i++) {
-		ssd_init_nand_page(&blk->pg[i], spp);
-	}
+	/* page state is allocated by ssd_materialize_blk() once the line is opened */
+	blk->pg_written = NULL;
+	blk->pg_valid = NULL;
+	blk->pg_ruh = NULL;
+
 	blk->ipc = 0;
 	blk->vpc = 0;
 	blk->erase_cnt = 0;
 	blk->wp = 0;
+	blk->prog_etime = 0;
 }
 
 static void ssd_remove_nand_blk(struct nand_block *blk)
 {
-	int i;
-
-	for (i = 0; i < blk->npgs; i++)
-		ssd_remove_nand_page(&blk->pg[i]);
-
-	kfree(blk->pg);
+	kvfree(blk->pg_written);
 }
 
 static void ssd_init_nand_plane(struct nand_plane *pl, struct ssdparams *spp)
@@ -273,6 +367,12 @@ static void ssd_init_nand_lun(struct nand_lun *lun, struct ssdparams *spp)
 	}
 	lun->next_lun_avail_time = 0;
 	lun->busy = false;
+	lun->pe_stime = 0;
+	lun->pe_etime = 0;
+	lun->pe_resume_time = 0;
+	lun->pe_suspends = 0;
+	lun->nr_sched = 0;
+	lun->sched_base = 0;
 }
 
 static void ssd_remove_nand_lun(struct nand_lun *lun)
@@ -315,21 +415,133 @@ static void ssd_remove_ch(struct ssd_channel *ch)
 
 void ssd_init_pcie(struct ssd_pcie *pcie, struct ssdparams *spp)
 {
-	pcie->perf_model = vmalloc_node(sizeof(struct channel_model), 1);
-	pci_chmodel_init(pcie->perf_model, spp->pcie_bandwidth);
+	int dir;
+
+	for (dir = 0; dir < NR_PCIE_DIRS; dir++) {
+		pcie->perf_model[dir] = vmalloc_node(sizeof(struct channel_model), 1);
+		spin_lock_init(&pcie->lock[dir]);
+		pci_chmodel_init(pcie->perf_model[dir], spp->pcie_bandwidth);
+	}
+}
+
+void ssd_remove_pcie(struct ssd_pcie *pcie)
+{
+	int dir;
+
+	for (dir = 0; dir < NR_PCIE_DIRS; dir++)
+		vfree(pcie->perf_model[dir]);
+	kfree(pcie);
+}
+
+struct ssd_init_worker {
+	void (*fn)(void *arg, unsigned int idx);
+	void *arg;
+	unsigned int first;
+	unsigned int stride;
+	unsigned int nr_jobs;
+	struct completion done;
+};
+
+static int ssd_init_worker_fn(void *data)
+{
+	struct ssd_init_worker *w = (struct ssd_init_worker *)data;
+	unsigned int i;
+
+	for (i = w->first; i < w->nr_jobs; i += w->stride)
+		w->fn(w->arg, i);
+
+	complete(&w->done);
+	return 0;
+}
+
+/*
+ * Run fn(arg, 0 .. nr_jobs - 1) spread over the IO worker CPUs and wait for
+ * all of them. Only meant for module load, before the IO workers start.
+ */
+void ssd_parallel_run(void (*fn)(void *arg, unsigned int idx), void *arg, unsigned int nr_jobs)
+{
+	unsigned int nr_workers = min(vdev->config.nr_io_cpu, nr_jobs);
+	struct ssd_init_worker *workers = NULL;
+	struct task_struct *task;
+	unsigned int i;
+
+	if (nr_workers > 1)
+		workers = kcalloc_node(nr_workers, sizeof(struct ssd_init_worker), GFP_KERNEL, 1);
+
+	if (!workers) {
+		for (i = 0; i < nr_jobs; i++)
+			fn(arg, i);
+		return;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		struct ssd_init_worker *w = &workers[i];
+
+		w->fn = fn;
+		w->arg = arg;
+		w->first = i;
+		w->stride = nr_workers;
+		w->nr_jobs = nr_jobs;
+		init_completion(&w->done);
+
+		task = kthread_create(ssd_init_worker_fn, w, "nvmev_init_%u", i);
+		if (IS_ERR(task)) {
+			ssd_init_worker_fn(w);
+			continue;
+		}
+		kthread_bind(task, vdev->config.cpu_nr_proc_io[i]);
+		wake_up_process(task);
+	}
+
+	for (i = 0; i < nr_workers; i++)
+		wait_for_completion(&workers[i].done);
+
+	kfree(workers);
+}
+
+#define PARALLEL_MEMSET_CHUNK (64ULL << 20)
+
+struct ssd_memset_job {
+	void *dst;
+	int c;
+	size_t size;
+};
+
+static void __ssd_memset_job(void *arg, unsigned int idx)
+{
+	struct ssd_memset_job *job = (struct ssd_memset_job *)arg;
+	size_t offs = (size_t)idx * PARALLEL_MEMSET_CHUNK;
+
+	memset(job->dst + offs, job->c, min_t(size_t, PARALLEL_MEMSET_CHUNK, job->size - offs));
+	cond_resched();
+}
+
+void ssd_parallel_memset(void *dst, int c, size_t size)
+{
+	struct ssd_memset_job job = {
+		.dst = dst,
+		.c = c,
+		.size = size,
+	};
+
+	ssd_parallel_run(__ssd_memset_job, &job, DIV_ROUND_UP(size, PARALLEL_MEMSET_CHUNK));
+}
+
+static void __ssd_init_ch_job(void *arg, unsigned int idx)
+{
+	struct ssd *ssd = (struct ssd *)arg;
+
+	ssd_init_ch(&(ssd->ch[idx]), &ssd->sp);
 }
 
 void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher)
 {
-	uint32_t i;
 	/* copy spp */
 	ssd->sp = *spp;
 
-	/* initialize conv_ftl internal layout architecture */
+	/* initialize conv_ftl internal layout architecture, one channel per job */
 	ssd->ch = kmalloc_node(sizeof(struct ssd_channel) * spp->nchs, GFP_KERNEL, 1); // 40 * 8 = 320
-	for (i = 0; i < spp->nchs; i++) {
-		ssd_init_ch(&(ssd->ch[i]), spp);
-	}
+	ssd_parallel_run(__ssd_init_ch_job, ssd, spp->nchs);
 
 	/* Set CPU number to use same cpuclock as io.c */
 	ssd->cpu_nr_dispatcher = cpu_nr_dispatcher;
@@ -347,11 +559,11 @@ void ssd_remove(struct ssd *ssd)
 {
 	uint32_t i;
 
+	if (ssd->write_buffer)
+		buffer_remove(ssd->write_buffer);
 	kfree(ssd->write_buffer);
-	if (ssd->pcie) {
-		vfree(ssd->pcie->perf_model);
-		kfree(ssd->pcie);
-	}
+	if (ssd->pcie)
+		ssd_remove_pcie(ssd->pcie);
 
 	for (i = 0; i < ssd->sp.nchs; i++) {
 		ssd_remove_ch(&(ssd->ch[i]));
@@ -360,10 +572,124 @@ void ssd_remove(struct ssd *ssd)
 	kfree(ssd->ch);
 }
 
-inline uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length)
+/* per-block record of a snapshot, followed by the page state if materialized */
+struct ssd_snapshot_blk {
+	int32_t ipc;
+	int32_t vpc;
+	int32_t erase_cnt;
+	int32_t wp;
+	uint32_t materialized;
+};
+
+#define for_each_nand_blk(ssd, blk, c, l, p, b)                          \
+	for (c = 0; c < (ssd)->sp.nchs; c++)                                 \
+		for (l = 0; l < (ssd)->sp.luns_per_ch; l++)                      \
+			for (p = 0; p < (ssd)->sp.pls_per_lun; p++)                  \
+				for (b = 0; b < (ssd)->sp.blks_per_pl &&                 \
+					 ((blk) = &(ssd)->ch[c].lun[l].pl[p].blk[b]); b++)
+
+/* worst case, i.e. with every block materialized */
+size_t ssd_snapshot_size(struct ssd *ssd)
+{
+	struct ssdparams *spp = &ssd->sp;
+
+	return (sizeof(struct ssd_snapshot_blk) + blk_meta_size(spp->pgs_per_blk)) * spp->tt_blks;
+}
+
+void *ssd_snapshot_save(struct ssd *ssd, void *dst)
 {
-	struct channel_model *perf_model = ssd->pcie->perf_model;
-	return pci_chmodel_request(perf_model, request_time, length);
+	struct nand_block *blk;
+	int c, l, p, b;
+
+	for_each_nand_blk(ssd, blk, c, l, p, b) {
+		struct ssd_snapshot_blk *rec = dst;
+
+		rec->ipc = blk->ipc;
+		rec->vpc = blk->vpc;
+		rec->erase_cnt = blk->erase_cnt;
+		rec->wp = blk->wp;
+		rec->materialized = (blk->pg_written != NULL);
+		dst += sizeof(*rec);
+
+		if (rec->materialized) {
+			memcpy(dst, blk->pg_written, blk_meta_size(blk->npgs));
+			dst += blk_meta_size(blk->npgs);
+		}
+	}
+
+	return dst;
+}
+
+/*
+ * Allocate the page state of every block the snapshot at src has materialized,
+ * before anything is restored. Returns the end of the records, or NULL if out
+ * of memory.
+ */
+void *ssd_snapshot_reserve(struct ssd *ssd, void *src)
+{
+	struct nand_block *blk;
+	int c, l, p, b;
+
+	for_each_nand_blk(ssd, blk, c, l, p, b) {
+		struct ssd_snapshot_blk *rec = src;
+
+		src += sizeof(*rec);
+		if (rec->materialized) {
+			if (ssd_materialize_blk(blk))
+				return NULL;
+			src += blk_meta_size(blk->npgs);
+		}
+	}
+
+	return src;
+}
+
+void *ssd_snapshot_load(struct ssd *ssd, void *src)
+{
+	struct nand_block *blk;
+	int c, l, p, b;
+
+	for_each_nand_blk(ssd, blk, c, l, p, b) {
+		struct ssd_snapshot_blk *rec = src;
+
+		blk->ipc = rec->ipc;
+		blk->vpc = rec->vpc;
+		blk->erase_cnt = rec->erase_cnt;
+		blk->wp = rec->wp;
+		blk->prog_etime = 0;
+		src += sizeof(*rec);
+
+		if (rec->materialized) {
+			/* allocated by ssd_snapshot_reserve() */
+			NVMEV_ASSERT(blk->pg_written);
+			memcpy(blk->pg_written, src, blk_meta_size(blk->npgs));
+			src += blk_meta_size(blk->npgs);
+		} else {
+			reset_blk_pgs(blk);
+		}
+	}
+
+	return src;
+}
+
+/*
+ * Move length bytes of payload in direction dir (PCIE_H2D or PCIE_D2H). The
+ * payload is split into max-payload-size TLPs, each of which also puts its
+ * header, framing and LCRC on the wire.
+ */
+inline uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length, int dir)
+{
+	struct ssdparams *spp = &ssd->sp;
+	struct channel_model *perf_model = ssd->pcie->perf_model[dir];
+	uint64_t nsecs_completed;
+
+	length += DIV_ROUND_UP(length, spp->pcie_mps) * spp->pcie_tlp_overhead[dir];
+
+	spin_lock(&ssd->pcie->lock[dir]);
+	nsecs_completed = pci_chmodel_request(perf_model, request_time, length);
+	spin_unlock(&ssd->pcie->lock[dir]);
+
+	return nsecs_completed;
 }
 
 /* Write buffer Performance Model
@@ -382,13 +708,141 @@ uint64_t ssd_advance_write_buffer(struct ssd *ssd, uint64_t request_time, uint64
 	nsecs_latest += spp->fw_wbuf_lat1 * DIV_ROUND_UP(length, KB(4));
 
 	if (interleave_pci_dma)
-		nsecs_latest = ssd_advance_pcie(ssd, nsecs_latest, length);
+		nsecs_latest = ssd_advance_pcie(ssd, nsecs_latest, length, PCIE_H2D);
 
 	return nsecs_latest;
 }
 
 volatile uint64_t g_nand_writes = 0;
 
+/*
+ * A host read may suspend the program/erase that is running on the die,
+ * provided nothing else is queued behind it. A read arriving while the
+ * operation is already suspended only queues behind the previous read.
+ */
+static bool __nand_can_suspend(struct ssdparams *spp, struct nand_lun *lun, struct nand_cmd *ncmd,
+							   uint64_t cmd_stime)
+{
+	if (spp->max_pe_suspends == 0 || ncmd->type != USER_IO)
+		return false;
+	if (lun->next_lun_avail_time != lun->pe_etime || cmd_stime < lun->pe_stime || cmd_stime >= lun->pe_etime)
+		return false;
+	return cmd_stime < lun->pe_resume_time || lun->pe_suspends < spp->max_pe_suspends;
+}
+
+static void __nand_start_pe(struct nand_lun *lun, uint64_t nand_stime, uint64_t nand_etime)
+{
+	lun->pe_stime = nand_stime;
+	lun->pe_etime = nand_etime;
+	lun->pe_resume_time = 0;
+	lun->pe_suspends = 0;
+}
+
+static void __nand_sched_retire(struct nand_lun *lun)
+{
+	lun->sched_base = lun->sched[0].etime;
+	lun->nr_sched--;
+	memmove(&lun->sched[0], &lun->sched[1], sizeof(lun->sched[0]) * lun->nr_sched);
+}
+
+static bool __nand_sched_can_pass(struct ssdparams *spp, struct nand_cmd *ncmd, struct nand_sched_op *op)
+{
+	bool read_first = ncmd->type == USER_IO && ncmd->cmd == NAND_READ &&
+					  !(op->type == USER_IO && op->cmd == NAND_READ);
+	bool gc_last = ncmd->type == USER_IO && ncmd->cmd != NAND_ERASE && op->type == GC_IO;
+
+	switch (spp->nand_sched) {
+	case NAND_SCHED_READ_FIRST:
+		return read_first;
+	case NAND_SCHED_GC_LAST:
+		return gc_last;
+	case NAND_SCHED_WEIGHTED:
+		return (read_first || gc_last) && op->passed < spp->nand_sched_weight;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Position of a new operation in the die's window: behind everything for
+ * FCFS, otherwise ahead of the queued operations it may pass that have not
+ * started by cmd_stime. *lun_free is when the die is free for it there.
+ */
+static int __nand_sched_pos(struct ssdparams *spp, struct nand_lun *lun, struct nand_cmd *ncmd,
+							uint64_t cmd_stime, uint64_t *lun_free)
+{
+	int pos;
+
+	if (spp->nand_sched == NAND_SCHED_FCFS) {
+		*lun_free = lun->next_lun_avail_time;
+		return 0;
+	}
+
+	/* operations that are done, or fall off the window, can no longer move */
+	while (lun->nr_sched > 0 && (lun->sched[0].etime <= cmd_stime || lun->nr_sched == NAND_SCHED_WINDOW))
+		__nand_sched_retire(lun);
+
+	pos = lun->nr_sched;
+	while (pos > 0 && lun->sched[pos - 1].stime > cmd_stime && __nand_sched_can_pass(spp, ncmd, &lun->sched[pos - 1]))
+		pos--;
+
+	if (pos == lun->nr_sched)
+		*lun_free = lun->next_lun_avail_time;
+	else
+		*lun_free = (pos > 0) ? lun->sched[pos - 1].etime : lun->sched_base;
+	return pos;
+}
+
+/*
+ * Queue an operation at pos, pushing the ones it passed back as needed. The
+ * program/erase tracked for suspend moves along if it is one of them.
+ */
+static void __nand_sched_insert(struct ssdparams *spp, struct nand_lun *lun, int pos, struct nand_cmd *ncmd,
+								uint64_t stime, uint64_t nand_stime, uint64_t etime)
+{
+	uint64_t t = etime, shift;
+	int i;
+
+	if (spp->nand_sched == NAND_SCHED_FCFS) {
+		lun->next_lun_avail_time = etime;
+		return;
+	}
+
+	for (i = pos; i < lun->nr_sched; i++) {
+		struct nand_sched_op *op = &lun->sched[i];
+
+		op->passed++;
+		if (op->stime < t) {
+			shift = t - op->stime;
+			if (op->cmd != NAND_READ && op->nand_stime == lun->pe_stime) {
+				lun->pe_stime += shift;
+				lun->pe_etime += shift;
+			}
+			op->stime += shift;
+			op->nand_stime += shift;
+			op->etime += shift;
+		}
+		t = op->etime;
+	}
+
+	memmove(&lun->sched[pos + 1], &lun->sched[pos], sizeof(lun->sched[0]) * (lun->nr_sched - pos));
+	lun->sched[pos] = (struct nand_sched_op){
+		.stime = stime,
+		.nand_stime = nand_stime,
+		.etime = etime,
+		.type = ncmd->type,
+		.cmd = ncmd->cmd,
+		.passed = 0,
+	};
+	lun->nr_sched++;
+	lun->next_lun_avail_time = lun->sched[lun->nr_sched - 1].etime;
+}
+
+/*
+ * A command occupies the whole die: a read or program of several planes is
+ * issued as one multi-plane command, with xfer_size covering all of them,
+ * so tR/tPROG is paid once while the channel moves every plane's data.
+ */
 uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 {
 	int c = ncmd->cmd;
@@ -401,6 +855,9 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	struct ssd_channel *ch;
 	struct ppa *ppa = ncmd->ppa;
 	uint32_t cell;
+	bool suspend = false;
+	uint64_t lun_free;
+	int pos = 0;
 	NVMEV_DEBUG("SSD: %p, Enter stime: %lld, ch %lu lun %lu blk %lu page %lu command %d ppa 0x%llx\n", ssd, ncmd->stime,
 				ppa->g.ch, ppa->g.lun, ppa->g.blk, ppa->g.pg, c, ppa->ppa);
 
@@ -415,10 +872,23 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 	cell = get_cell(ssd, ppa);
 	remaining = ncmd->xfer_size;
 
+	/* a host read suspends the running program/erase, or is scheduled on the die */
+	if (c == NAND_READ)
+		suspend = __nand_can_suspend(spp, lun, ncmd, cmd_stime);
+	if (!suspend && c != NAND_NOP)
+		pos = __nand_sched_pos(spp, lun, ncmd, cmd_stime, &lun_free);
+
 	switch (c) {
 	case NAND_READ:
-		/* read: perform NAND cmd first */
-		nand_stime = (lun->next_lun_avail_time < cmd_stime) ? cmd_stime : lun->next_lun_avail_time;
+		/* read: perform NAND cmd first, suspending a program/erase if allowed */
+		if (!suspend) {
+			nand_stime = (lun_free < cmd_stime) ? cmd_stime : lun_free;
+		} else if (cmd_stime < lun->pe_resume_time) {
+			nand_stime = lun->pe_resume_time;
+		} else {
+			nand_stime = cmd_stime + spp->pe_suspend_lat;
+			lun->pe_suspends++;
+		}
 		if (ncmd->nand_stime < nand_stime) {
 			ncmd->nand_stime = nand_stime;
 		}
@@ -438,7 +908,7 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 			chnl_etime = chmodel_request(ch->perf_model, chnl_stime, xfer_size);
 
 			if (ncmd->interleave_pci_dma) { /* overlap pci transfer with nand ch transfer*/
-				completed_time = ssd_advance_pcie(ssd, chnl_etime, xfer_size);
+				completed_time = ssd_advance_pcie(ssd, chnl_etime, xfer_size, PCIE_D2H);
 			} else {
 				completed_time = chnl_etime;
 			}
@@ -447,28 +917,46 @@ uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd)
 			chnl_stime = chnl_etime;
 		}
 
-		lun->next_lun_avail_time = chnl_etime;
+		if (suspend) {
+			/* the program/erase loses the time the die spent on this read */
+			if (cmd_stime < lun->pe_resume_time)
+				lun->pe_etime += chnl_etime - lun->pe_resume_time;
+			else
+				lun->pe_etime += chnl_etime - cmd_stime + spp->pe_resume_lat;
+			lun->pe_resume_time = chnl_etime;
+			lun->next_lun_avail_time = lun->pe_etime;
+			if (lun->nr_sched > 0)
+				lun->sched[lun->nr_sched - 1].etime = lun->pe_etime;
+		} else {
+			__nand_sched_insert(spp, lun, pos, ncmd, nand_stime, nand_stime, chnl_etime);
+		}
 		break;
 
 	case NAND_WRITE:
+	case NAND_SLC_WRITE:
 		g_nand_writes++;
 		/* write: transfer data through channel first */
-		chnl_stime = (lun->next_lun_avail_time < cmd_stime) ? cmd_stime : lun->next_lun_avail_time;
+		chnl_stime = (lun_free < cmd_stime) ? cmd_stime : lun_free;
 
 		chnl_etime = chmodel_request(ch->perf_model, chnl_stime, ncmd->xfer_size);
 
 		/* write: then do NAND program */
 		nand_stime = chnl_etime;
-		nand_etime = nand_stime + spp->pg_wr_lat;
-		lun->next_lun_avail_time = nand_etime;
+		nand_etime = nand_stime + ((c == NAND_SLC_WRITE) ? spp->slc_wr_lat : spp->pg_wr_lat);
+		/* only the last operation on the die can be suspended */
+		if (pos == lun->nr_sched)
+			__nand_start_pe(lun, nand_stime, nand_etime);
+		__nand_sched_insert(spp, lun, pos, ncmd, chnl_stime, nand_stime, nand_etime);
 		completed_time = nand_etime;
 		break;
 
 	case NAND_ERASE:
 		/* erase: only need to advance NAND status */
-		nand_stime = (lun->next_lun_avail_time < cmd_stime) ? cmd_stime : lun->next_lun_avail_time;
+		nand_stime = (lun_free < cmd_stime) ? cmd_stime : lun_free;
 		nand_etime = nand_stime + spp->blk_er_lat;
-		lun->next_lun_avail_time = nand_etime;
+		if (pos == lun->nr_sched)
+			__nand_start_pe(lun, nand_stime, nand_etime);
+		__nand_sched_insert(spp, lun, pos, ncmd, nand_stime, nand_stime, nand_etime);
 		completed_time = nand_etime;
 		break;
 
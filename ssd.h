@@ -16,6 +16,8 @@
 #define _NVMEVIRT_SSD_H
 
 #include <linux/types.h>
+#include <linux/bitops.h>
+#include <linux/spinlock.h>
 #include "pqueue.h"
 #include "ssd_config.h"
 #include "channel_model.h"
@@ -42,6 +44,7 @@ enum {
 	NAND_WRITE = 1,
 	NAND_ERASE = 2,
 	NAND_NOP = 3,
+	NAND_SLC_WRITE = 4, /* a wordline worth of data programmed in SLC mode */
 };
 
 enum {
@@ -92,22 +95,39 @@ struct ppa {
 	};
 };
 
-typedef int nand_sec_status_t;
+#define PG_RUH_NONE (0xFF)
 
+/*
+ * Decoded view of one page, returned by get_pg(). Page state itself is kept
+ * packed in the owning block (see struct nand_block); sectors always share
+ * the state of their page since secs_per_pg is 1.
+ */
 struct nand_page {
-	nand_sec_status_t *sec;
-	int nsecs;
 	int status;
-	uint16_t ruh;
+	uint8_t ruh;
 };
 
+/*
+ * Page state is packed per block:
+ *  - pg_written: page has been programmed since the last erase
+ *  - pg_valid  : page holds live data
+ *  - pg_ruh    : RUH the page was written with, PG_RUH_NONE if free
+ * A page is PG_FREE if not written, PG_VALID if written and valid, and
+ * PG_INVALID otherwise. All three arrays live in a single allocation that
+ * is only made when the block's line is first opened for writes
+ * (ssd_materialize_blk()); until then every page of the block reads as
+ * PG_FREE.
+ */
 struct nand_block {
-	struct nand_page *pg;
+	unsigned long *pg_written;
+	unsigned long *pg_valid;
+	uint8_t *pg_ruh;
 	int npgs;
 	int ipc; /* invalid page count */
 	int vpc; /* valid page count */
 	int erase_cnt;
-	int wp; /* current write pointer */
+	int wp; /* pages handed to NAND programs, the rest are in the write buffer */
+	uint64_t prog_etime; /* completion of the last program, whose pages stay buffered until then */
 };
 
 struct nand_plane {
@@ -116,12 +136,44 @@ struct nand_plane {
 	int nblks;
 };
 
+/* Command scheduling on a die, chosen by the nand_sched parameter */
+enum {
+	NAND_SCHED_FCFS = 0,
+	NAND_SCHED_READ_FIRST = 1, /* host reads go ahead of queued programs, erases and GC reads */
+	NAND_SCHED_GC_LAST = 2, /* host reads and programs go ahead of queued GC operations */
+	NAND_SCHED_WEIGHTED = 3, /* both, but an operation is passed at most nand_sched_weight times */
+	NR_NAND_SCHEDS,
+};
+
+/* operations per die that may still be reordered */
+#define NAND_SCHED_WINDOW (8)
+
+struct nand_sched_op {
+	uint64_t stime; /* die busy from stime to etime */
+	uint64_t nand_stime; /* array operation starts, after the data-in of a program */
+	uint64_t etime;
+	uint8_t type; /* USER_IO or GC_IO */
+	uint8_t cmd;
+	uint8_t passed; /* times a later operation went ahead of it */
+};
+
 struct nand_lun {
 	struct nand_plane *pl;
 	int npls;
 	uint64_t next_lun_avail_time;
 	bool busy;
 	uint64_t gc_endtime;
+
+	/* last program/erase issued to the die, for suspend/resume */
+	uint64_t pe_stime; /* array operation started */
+	uint64_t pe_etime; /* completes, pushed out by suspends */
+	uint64_t pe_resume_time; /* the die is back to the program/erase after the reads */
+	int pe_suspends;
+
+	/* queued operations, in die order; unused with NAND_SCHED_FCFS */
+	struct nand_sched_op sched[NAND_SCHED_WINDOW];
+	int nr_sched;
+	uint64_t sched_base; /* end of the last operation that left the window */
 };
 
 struct ssd_channel {
@@ -131,8 +183,16 @@ struct ssd_channel {
 	struct channel_model *perf_model;
 };
 
+/* PCIe is full duplex, each direction has its own link model */
+enum {
+	PCIE_H2D = 0, /* host to device: write data */
+	PCIE_D2H = 1, /* device to host: read data */
+	NR_PCIE_DIRS,
+};
+
 struct ssd_pcie {
-	struct channel_model *perf_model;
+	struct channel_model *perf_model[NR_PCIE_DIRS];
+	spinlock_t lock[NR_PCIE_DIRS]; /* shared by all partitions */
 };
 
 struct nand_cmd {
@@ -146,10 +206,24 @@ struct nand_cmd {
 	struct ppa *ppa;
 };
 
+/* a writeback in flight: bytes return to the write buffer at etime */
+struct buffer_wb {
+	uint64_t etime;
+	uint32_t bytes;
+};
+
+/*
+ * The write buffer is accounted in emulated time. Writes take space at their
+ * start time, and writebacks give it back when their program completes, so a
+ * write into a full buffer starts once enough writebacks have completed.
+ */
 struct buffer {
 	uint32_t initial;
-	uint32_t remaining;
 	spinlock_t lock;
+	int64_t free; /* bytes neither taken by a write nor waiting for a writeback */
+	struct buffer_wb *wb; /* writebacks in flight, min-heap on etime */
+	uint32_t nr_wb;
+	uint32_t max_wb;
 };
 
 /*
@@ -183,17 +257,26 @@ struct ssdparams {
 	int pg_4kb_rd_lat[MAX_CELL_TYPES]; /* NAND page 4KB read latency in nanoseconds. sensing time (half tR) */
 	int pg_rd_lat[MAX_CELL_TYPES]; /* NAND page read latency in nanoseconds. sensing time (tR) */
 	int pg_wr_lat; /* NAND page program latency in nanoseconds. pgm time (tPROG)*/
+	int slc_wr_lat; /* programming the data of one wordline in SLC mode, cell_mode SLC pages */
 	int blk_er_lat; /* NAND block erase latency in nanoseconds. erase time (tERASE) */
+	int pe_suspend_lat; /* time for a host read to suspend a program/erase */
+	int pe_resume_lat; /* time for the program/erase to resume after the read */
+	int max_pe_suspends; /* suspends allowed per program/erase, 0: never suspend */
+	int nand_sched; /* NAND_SCHED_* */
+	int nand_sched_weight; /* NAND_SCHED_WEIGHTED: passes allowed per operation */
 	int max_ch_xfer_size;
 
 	int fw_4kb_rd_lat; /* Firmware overhead of 4KB read of read in nanoseconds */
 	int fw_rd_lat; /* Firmware overhead of read of read in nanoseconds */
+	int fw_cache_rd_lat; /* Read served from controller DRAM in nanoseconds */
 	int fw_wbuf_lat0; /* Firmware overhead0 of write buffer in nanoseconds */
 	int fw_wbuf_lat1; /* Firmware overhead1 of write buffer in nanoseconds */
 	int fw_ch_xfer_lat; /* Firmware overhead of nand channel data transfer(4KB) in nanoseconds */
 
 	uint64_t ch_bandwidth; /*NAND CH Maximum bandwidth in MiB/s*/
-	uint64_t pcie_bandwidth; /*PCIE Maximum bandwidth in MiB/s*/
+	uint64_t pcie_bandwidth; /*PCIE Maximum bandwidth per direction in MiB/s*/
+	uint32_t pcie_mps; /* PCIe max payload size in bytes */
+	uint32_t pcie_tlp_overhead[NR_PCIE_DIRS]; /* wire bytes added to each TLP */
 
 	/* below are all calculated values */
 	unsigned long secs_per_blk; /* # of sectors per block */
@@ -255,10 +338,38 @@ static inline struct nand_block *get_blk(struct ssd *ssd, struct ppa *ppa)
 	return &(pl->blk[ppa->g.blk]);
 }
 
-static inline struct nand_page *get_pg(struct ssd *ssd, struct ppa *ppa)
+static inline struct nand_page get_pg(struct ssd *ssd, struct ppa *ppa)
 {
 	struct nand_block *blk = get_blk(ssd, ppa);
-	return &(blk->pg[ppa->g.pg]);
+	struct nand_page pg = { .status = PG_FREE, .ruh = PG_RUH_NONE };
+
+	if (blk->pg_written && test_bit(ppa->g.pg, blk->pg_written)) {
+		pg.status = test_bit(ppa->g.pg, blk->pg_valid) ? PG_VALID : PG_INVALID;
+		pg.ruh = blk->pg_ruh[ppa->g.pg];
+	}
+	return pg;
+}
+
+static inline void set_pg_valid(struct nand_block *blk, uint32_t pg, uint8_t ruh)
+{
+	__set_bit(pg, blk->pg_written);
+	__set_bit(pg, blk->pg_valid);
+	blk->pg_ruh[pg] = ruh;
+}
+
+static inline void set_pg_invalid(struct nand_block *blk, uint32_t pg)
+{
+	__clear_bit(pg, blk->pg_valid);
+}
+
+static inline void reset_blk_pgs(struct nand_block *blk)
+{
+	if (!blk->pg_written)
+		return;
+
+	bitmap_zero(blk->pg_written, blk->npgs);
+	bitmap_zero(blk->pg_valid, blk->npgs);
+	memset(blk->pg_ruh, PG_RUH_NONE, blk->npgs);
 }
 
 static inline uint32_t get_cell(struct ssd *ssd, struct ppa *ppa)
@@ -269,18 +380,30 @@ static inline uint32_t get_cell(struct ssd *ssd, struct ppa *ppa)
 
 void ssd_init_ch(struct ssd_channel *ch, struct ssdparams *spp);
 void ssd_init_pcie(struct ssd_pcie *pcie, struct ssdparams *spp);
+void ssd_remove_pcie(struct ssd_pcie *pcie);
 void ssd_init_params(struct ssdparams *spp, uint64_t capacity, uint32_t nparts);
 void ssd_init(struct ssd *ssd, struct ssdparams *spp, uint32_t cpu_nr_dispatcher);
 void ssd_remove(struct ssd *ssd);
+int ssd_materialize_blk(struct nand_block *blk);
+
+size_t ssd_snapshot_size(struct ssd *ssd);
+void *ssd_snapshot_save(struct ssd *ssd, void *dst);
+void *ssd_snapshot_reserve(struct ssd *ssd, void *src);
+void *ssd_snapshot_load(struct ssd *ssd, void *src);
+
+void ssd_parallel_run(void (*fn)(void *arg, unsigned int idx), void *arg, unsigned int nr_jobs);
+void ssd_parallel_memset(void *dst, int c, size_t size);
 
 uint64_t ssd_advance_nand(struct ssd *ssd, struct nand_cmd *ncmd);
-uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length);
+uint64_t ssd_advance_pcie(struct ssd *ssd, uint64_t request_time, uint64_t length, int dir);
 uint64_t ssd_advance_write_buffer(struct ssd *ssd, uint64_t request_time, uint64_t length, bool interleave_pci_dma);
 uint64_t ssd_next_idle_time(struct ssd *ssd);
 
 void buffer_init(struct buffer *buf, uint32_t size);
-uint32_t buffer_allocate(struct buffer *buf, uint32_t size);
+void buffer_remove(struct buffer *buf);
+bool buffer_allocate(struct buffer *buf, uint32_t size, uint64_t *nsecs_start);
 bool buffer_release(struct buffer *buf, uint32_t size);
+void buffer_release_at(struct buffer *buf, uint64_t etime, uint32_t size);
 void buffer_refill(struct buffer *buf);
 
 void adjust_ftl_latency(int target, int lat);
@@ -289,5 +412,6 @@ void adjust_ftl_latency(int target, int lat);
 extern atomic64_t g_buffer_allocate_bytes;
 extern atomic64_t g_buffer_enqueue_bytes;
 extern atomic64_t g_buffer_release_bytes;
+extern atomic64_t g_buffer_wait_ns;
 extern atomic64_t g_last_pg_in_wordline_bytes;
 #endif
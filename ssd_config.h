@@ -80,7 +80,7 @@ enum {
 #define SSD_PARTITIONS (2)
 #define NAND_CHANNELS (8)
 #define LUNS_PER_NAND_CH (8)
-#define PLNS_PER_LUN (1)
+#define PLNS_PER_LUN (1) /* planes per die, programmed and read together (multi-plane) */
 #define FLASH_PAGE_SIZE (16 * 1024)
 #define ONESHOT_PAGE_SIZE (FLASH_PAGE_SIZE * 3)
 // #define BLKS_PER_PLN (8192)
@@ -91,7 +91,10 @@ enum {
 #define WRITE_UNIT_SIZE (4096)
 
 #define NAND_CHANNEL_BANDWIDTH (1400ull) //MB/s Spec notes as 1600 MB/s
-#define PCIE_BANDWIDTH (11000ull) //MB/s
+#define PCIE_BANDWIDTH (12000ull) //MB/s per direction, ~11000MB/s of payload after TLP overhead
+#define PCIE_MAX_PAYLOAD (256) //bytes
+#define PCIE_H2D_TLP_OVERHEAD (20) //bytes, CplD: 3DW header, framing, sequence number, LCRC
+#define PCIE_D2H_TLP_OVERHEAD (24) //bytes, MWr: 4DW header, framing, sequence number, LCRC
 
 #define NAND_4KB_READ_LATENCY_LSB (19000) //ns
 #define NAND_4KB_READ_LATENCY_MSB (19000) //ns
@@ -101,7 +104,11 @@ enum {
 #define NAND_READ_LATENCY_CSB (33000)
 
 #define NAND_PROG_LATENCY (650000)
+#define NAND_SLC_PROG_LATENCY (80000) /* per page, SLC cache */
 #define NAND_ERASE_LATENCY (0)
+#define NAND_SUSPEND_LATENCY (20000) /* host read preempting a program/erase */
+#define NAND_RESUME_LATENCY (10000)
+#define NAND_MAX_SUSPENDS (4) /* per program/erase, 0 disables suspend */
 
 #define FW_4KB_READ_LATENCY (37000)
 #define FW_READ_LATENCY (24000)
@@ -110,9 +117,12 @@ enum {
 #define FW_CH_XFER_LATENCY (0)
 #define OP_AREA_PERCENT (0.07)
 
-#define WRITE_BUFFER_SIZE (NAND_CHANNELS * LUNS_PER_NAND_CH * ONESHOT_PAGE_SIZE * 16 * NR_MAX_LEVEL)
+#define WRITE_BUFFER_SIZE (NAND_CHANNELS * LUNS_PER_NAND_CH * PLNS_PER_LUN * ONESHOT_PAGE_SIZE * 16 * NR_MAX_LEVEL)
 #define WRITE_EARLY_COMPLETION 1
 
+/* store maptbl/rmap entries as 32-bit page indices (needs < 2^32 pages per partition) */
+#define COMPACT_MAPTBL (1)
+
 static_assert((ONESHOT_PAGE_SIZE % FLASH_PAGE_SIZE) == 0);
 #elif (BASE_SSD == SAMSUNG_970PRO)
 #define NR_NAMESPACES 1
@@ -156,7 +166,7 @@ static_assert((ONESHOT_PAGE_SIZE % FLASH_PAGE_SIZE) == 0);
 #define FW_CH_XFER_LATENCY (0)
 #define OP_AREA_PERCENT (0.07)
 
-#define WRITE_BUFFER_SIZE (NAND_CHANNELS * LUNS_PER_NAND_CH * ONESHOT_PAGE_SIZE * 2)
+#define WRITE_BUFFER_SIZE (NAND_CHANNELS * LUNS_PER_NAND_CH * PLNS_PER_LUN * ONESHOT_PAGE_SIZE * 2)
 #define WRITE_EARLY_COMPLETION 1
 
 static_assert((ONESHOT_PAGE_SIZE % FLASH_PAGE_SIZE) == 0);
@@ -227,6 +237,30 @@ static_assert((ONESHOT_PAGE_SIZE % FLASH_PAGE_SIZE) == 0);
 #endif // BASE_SSD == ZNS_PROTOTYPE
 ///////////////////////////////////////////////////////////////////////////
 
+#ifndef COMPACT_MAPTBL
+#define COMPACT_MAPTBL (0)
+#endif
+
+#ifndef NAND_MAX_SUSPENDS
+#define NAND_SUSPEND_LATENCY (0)
+#define NAND_RESUME_LATENCY (0)
+#define NAND_MAX_SUSPENDS (0)
+#endif
+
+#ifndef NAND_SLC_PROG_LATENCY
+#define NAND_SLC_PROG_LATENCY (NAND_PROG_LATENCY / 8)
+#endif
+
+#ifndef FW_CACHE_READ_LATENCY
+#define FW_CACHE_READ_LATENCY (2000) /* read served from controller DRAM */
+#endif
+
+#ifndef PCIE_MAX_PAYLOAD
+#define PCIE_MAX_PAYLOAD (256)
+#define PCIE_H2D_TLP_OVERHEAD (0)
+#define PCIE_D2H_TLP_OVERHEAD (0)
+#endif
+
 static const uint32_t ns_ssd_type[] = { NS_SSD_TYPE_0, NS_SSD_TYPE_1 };
 static const uint64_t ns_capacity[] = { NS_CAPACITY_0, NS_CAPACITY_1 }; // MB
 